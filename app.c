@@ -3,12 +3,92 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <sys/msg.h>
+#include <sys/shm.h>
 #include <sys/types.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #define MAX_USERS 50
 #define MAX_GROUPS 30
+#define BUS_RING_SLOTS 4096
+#define MAX_MODERATORS 8
+#define MODERATOR_KEY_STRIDE 0x10000
+#define VERDICT_KEY_OFFSET 0x8000
+#define QUERY_KEY_OFFSET 0x4000
+#define MODERATOR_STOP_MTYPE (3 * MAX_GROUPS)
+#define CONFIG_SNAPSHOT_MAGIC 0x47464343
+#define CONFIG_SNAPSHOT_VERSION 1
+
+typedef struct {
+    long mtype;
+    int timestamp;
+    int user;
+    char mtext[256];
+    int modifyingGroup;
+} Message;
+
+/* Layout must match groups.c and moderator.c. */
+struct BusSlot {
+    unsigned int seq;
+    Message msg;
+};
+
+struct BusRing {
+    unsigned int head;
+    char head_pad[60];
+    unsigned int tail;
+    char tail_pad[60];
+    unsigned int consumer_waiting;
+    unsigned int producers_waiting;
+    char wait_pad[56];
+    struct BusSlot slots[BUS_RING_SLOTS];
+};
+
+/*
+ * Configuration snapshot: input.txt and every group manifest, parsed and
+ * validated once by app.c and published as the POSIX shared-memory object
+ * /chat-config-<test_case>. groups.c and moderator.c map it read-only
+ * instead of parsing the files again. The fixed header is followed by the
+ * per-group user path tables (arrays of offsets) and the NUL-terminated
+ * path strings; all offsets are from the start of the snapshot. magic is
+ * stored last, so a reader never sees a half-written snapshot, and the
+ * input.txt identity lets readers reject one left over from another run.
+ * Layout must match groups.c and moderator.c.
+ */
+struct ConfigSnapshotGroup {
+    unsigned int path;
+    int user_count;
+    unsigned int users;
+};
+
+struct ConfigSnapshot {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int size;
+    int test_case;
+    unsigned long long input_dev;
+    unsigned long long input_ino;
+    long long input_size;
+    long long input_mtime_ns;
+    int n;
+    int validation_queue_key;
+    int app_groups_queue_key;
+    int moderator_groups_queue_key;
+    int threshold;
+    struct ConfigSnapshotGroup groups[MAX_GROUPS];
+};
+
+struct SnapshotBuilder {
+    char *data;
+    size_t size;
+    size_t capacity;
+};
 
 struct message {
     long mtype;
@@ -18,51 +98,268 @@ struct AppMessage {
     long mtype;
     int group_id;
 };
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <test_case_number>\n", argv[0]);
-        exit(1);
+
+/*
+ * In-process group runtime (GROUP_THREADS=k): groups run as tasks on k pool
+ * threads instead of one groups.out process each. run_group comes from
+ * groups.c when app.out is linked with it (groups.c built with
+ * -DGROUPS_NO_MAIN); a plain app.out build leaves it NULL.
+ */
+int run_group(int group_id, int test_case, const struct ConfigSnapshot *config) __attribute__((weak));
+
+struct GroupPool {
+    int test_case;
+    const struct ConfigSnapshot *config;
+    int next_group;
+};
+
+void *group_pool_worker(void *arg) {
+    struct GroupPool *pool = arg;
+    while (1) {
+        int group = __atomic_fetch_add(&pool->next_group, 1, __ATOMIC_RELAXED);
+        if (group >= pool->config->n) {
+            return NULL;
+        }
+        run_group(group, pool->test_case, pool->config);
     }
+}
 
-    int test_case = atoi(argv[1]);
-    char testcase_folder[256];
-    snprintf(testcase_folder, sizeof(testcase_folder), "testcase_%d", test_case);
-    printf("Using testcase folder: %s\n", testcase_folder);
+static unsigned int snapshot_append(struct SnapshotBuilder *b, const void *data, size_t len) {
+    if (b->size + len > b->capacity) {
+        while (b->size + len > b->capacity) {
+            b->capacity = b->capacity ? b->capacity * 2 : 4096;
+        }
+        b->data = realloc(b->data, b->capacity);
+        if (b->data == NULL) {
+            fprintf(stderr, "Out of memory building configuration snapshot\n");
+            exit(1);
+        }
+    }
+    unsigned int offset = b->size;
+    memcpy(b->data + b->size, data, len);
+    b->size += len;
+    return offset;
+}
+
+static unsigned int snapshot_append_string(struct SnapshotBuilder *b, const char *str) {
+    return snapshot_append(b, str, strlen(str) + 1);
+}
 
-    int n, validation_queue_key, app_groups_queue_key, moderator_groups_queue_key, threshold;
-    char group_paths[MAX_GROUPS][256];
+/*
+ * Parses input.txt and every group file, checking everything the groups and
+ * the moderator would otherwise check (and fail on) separately.
+ */
+void build_config_snapshot(const char *testcase_folder, int test_case, struct SnapshotBuilder *b) {
+    struct ConfigSnapshot header;
+    memset(&header, 0, sizeof(header));
+    snapshot_append(b, &header, sizeof(header));
 
-    char input_file_path[256];
+    char input_file_path[512];
     snprintf(input_file_path, sizeof(input_file_path), "%s/input.txt", testcase_folder);
     FILE *input_file = fopen(input_file_path, "r");
     if (input_file == NULL) {
         fprintf(stderr, "Error opening %s: %s\n", input_file_path, strerror(errno));
         exit(1);
     }
+    struct stat st;
+    if (fstat(fileno(input_file), &st) == -1) {
+        fprintf(stderr, "Error reading %s: %s\n", input_file_path, strerror(errno));
+        exit(1);
+    }
+    header.test_case = test_case;
+    header.input_dev = st.st_dev;
+    header.input_ino = st.st_ino;
+    header.input_size = st.st_size;
+    header.input_mtime_ns = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
 
-    if (fscanf(input_file, "%d %d %d %d %d", &n, &validation_queue_key,
-               &app_groups_queue_key, &moderator_groups_queue_key, &threshold) != 5) {
+    if (fscanf(input_file, "%d %d %d %d %d", &header.n, &header.validation_queue_key,
+               &header.app_groups_queue_key, &header.moderator_groups_queue_key, &header.threshold) != 5) {
         fprintf(stderr, "Error reading from input.txt: Invalid format\n");
         exit(1);
     }
 
     printf("Read from input.txt: n=%d, validation_key=%d, app_key=%d, moderator_key=%d, threshold=%d\n",
-           n, validation_queue_key, app_groups_queue_key, moderator_groups_queue_key, threshold);
+           header.n, header.validation_queue_key, header.app_groups_queue_key,
+           header.moderator_groups_queue_key, header.threshold);
+
+    if (header.n <= 0 || header.n > MAX_GROUPS) {
+        fprintf(stderr, "Invalid number of groups: %d\n", header.n);
+        exit(1);
+    }
 
-    for (int i = 0; i < n; i++) {
-        if (fscanf(input_file, "%255s", group_paths[i]) != 1) {
+    for (int i = 0; i < header.n; i++) {
+        char group_path[256];
+        if (fscanf(input_file, "%255s", group_path) != 1) {
             fprintf(stderr, "Error reading group file paths from input.txt\n");
             exit(1);
         }
-        printf("Group %d path: %s\n", i, group_paths[i]);
+        printf("Group %d path: %s\n", i, group_path);
+        header.groups[i].path = snapshot_append_string(b, group_path);
+
+        char group_file_path[512];
+        snprintf(group_file_path, sizeof(group_file_path), "%s/%s", testcase_folder, group_path);
+        FILE *group_fp = fopen(group_file_path, "r");
+        if (group_fp == NULL) {
+            fprintf(stderr, "Error opening group file %s: %s\n", group_file_path, strerror(errno));
+            exit(1);
+        }
+        int m;
+        if (fscanf(group_fp, "%d", &m) != 1) {
+            fprintf(stderr, "Error reading number of users from group file %s\n", group_file_path);
+            exit(1);
+        }
+        if (m < 0 || m > MAX_USERS) {
+            fprintf(stderr, "Error: Group %d specifies %d users, which exceeds the maximum of %d\n", i, m, MAX_USERS);
+            exit(1);
+        }
+
+        unsigned int user_offsets[MAX_USERS];
+        for (int u = 0; u < m; u++) {
+            char user_file[256];
+            if (fscanf(group_fp, "%255s", user_file) != 1) {
+                fprintf(stderr, "Error reading user file path from group file %s\n", group_file_path);
+                exit(1);
+            }
+            char full_user_file_path[512];
+            snprintf(full_user_file_path, sizeof(full_user_file_path), "%s/%s", testcase_folder, user_file);
+            if (access(full_user_file_path, R_OK) == -1) {
+                fprintf(stderr, "Error opening user file %s: %s\n", full_user_file_path, strerror(errno));
+                exit(1);
+            }
+            user_offsets[u] = snapshot_append_string(b, full_user_file_path);
+        }
+        fclose(group_fp);
+
+        /* Keep the offset table aligned for readers. */
+        while (b->size % sizeof(unsigned int) != 0) {
+            snapshot_append(b, "", 1);
+        }
+        header.groups[i].user_count = m;
+        header.groups[i].users = snapshot_append(b, user_offsets, m * sizeof(unsigned int));
     }
     fclose(input_file);
 
-    if (n <= 0 || n > MAX_GROUPS) {
-        fprintf(stderr, "Invalid number of groups: %d\n", n);
+    header.version = CONFIG_SNAPSHOT_VERSION;
+    header.size = b->size;
+    memcpy(b->data, &header, sizeof(header));
+}
+
+/* Returns a read-only mapping of the published snapshot. */
+const struct ConfigSnapshot *publish_config_snapshot(const char *name, struct SnapshotBuilder *b) {
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "Error creating configuration snapshot %s: %s\n", name, strerror(errno));
+        exit(1);
+    }
+    if (ftruncate(fd, b->size) == -1) {
+        fprintf(stderr, "Error sizing configuration snapshot: %s\n", strerror(errno));
+        exit(1);
+    }
+    struct ConfigSnapshot *snapshot = mmap(NULL, b->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (snapshot == MAP_FAILED) {
+        fprintf(stderr, "Error mapping configuration snapshot: %s\n", strerror(errno));
+        exit(1);
+    }
+    memcpy(snapshot, b->data, b->size);
+    __atomic_store_n(&snapshot->magic, CONFIG_SNAPSHOT_MAGIC, __ATOMIC_RELEASE);
+    mprotect(snapshot, b->size, PROT_READ);
+    printf("Published configuration snapshot %s (%zu bytes)\n", name, b->size);
+    return snapshot;
+}
+/*
+ * CHAT_TRANSPORT=shm: group -> moderator traffic goes through a shared
+ * ring instead of the moderator queue. A freshly created segment is
+ * zero-filled, which is exactly the ring's empty state.
+ */
+static int create_bus(int key) {
+    int shmid = shmget(key, sizeof(struct BusRing), IPC_CREAT | IPC_EXCL | 0666);
+    if (shmid == -1 && errno == EEXIST) {
+        /* Stale segment from a previous run: recreate it so it starts empty. */
+        int stale = shmget(key, 0, 0666);
+        if (stale != -1) {
+            shmctl(stale, IPC_RMID, NULL);
+        }
+        shmid = shmget(key, sizeof(struct BusRing), IPC_CREAT | IPC_EXCL | 0666);
+    }
+    if (shmid == -1) {
+        fprintf(stderr, "Error creating shared message bus (key: %d): %s\n", key, strerror(errno));
+        exit(1);
+    }
+    printf("Successfully created shared message bus (id: %d)\n", shmid);
+    return shmid;
+}
+
+/* Runs ./moderator.out with the given arguments; returns its pid. */
+static pid_t spawn_moderator(const char *arg1, const char *arg2, const char *arg3) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        fprintf(stderr, "Fork failed for moderator: %s\n", strerror(errno));
+        exit(1);
+    } else if (pid == 0) {
+        execl("./moderator.out", "moderator.out", arg1, arg2, arg3, (char *)NULL);
+        fprintf(stderr, "execl failed for moderator: %s\n", strerror(errno));
+        exit(1);
+    }
+    return pid;
+}
+
+/*
+ * Queues MODERATOR_STOP_MTYPE for a moderator instance behind everything
+ * the groups sent it, on its queue or, with the shared bus, on its ring.
+ */
+static void stop_moderator_instance(int msgid, int bus_shmid) {
+    Message stop = {.mtype = MODERATOR_STOP_MTYPE, .modifyingGroup = -1};
+    if (bus_shmid == -1) {
+        if (msgsnd(msgid, &stop, sizeof(Message) - sizeof(long), 0) == -1) {
+            fprintf(stderr, "Error stopping moderator: %s\n", strerror(errno));
+        }
+        return;
+    }
+    struct BusRing *bus = shmat(bus_shmid, NULL, 0);
+    if (bus == (void *)-1) {
+        fprintf(stderr, "Error attaching shared message bus: %s\n", strerror(errno));
+        return;
+    }
+    unsigned int pos = __atomic_fetch_add(&bus->tail, 1, __ATOMIC_RELAXED);
+    while (pos - __atomic_load_n(&bus->head, __ATOMIC_ACQUIRE) >= BUS_RING_SLOTS) {
+        usleep(1000);
+    }
+    struct BusSlot *slot = &bus->slots[pos % BUS_RING_SLOTS];
+    slot->msg = stop;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&bus->consumer_waiting, __ATOMIC_SEQ_CST)) {
+        syscall(SYS_futex, &slot->seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+    shmdt(bus);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <test_case_number>\n", argv[0]);
         exit(1);
     }
 
+    int test_case = atoi(argv[1]);
+    char testcase_folder[256];
+    snprintf(testcase_folder, sizeof(testcase_folder), "testcase_%d", test_case);
+    printf("Using testcase folder: %s\n", testcase_folder);
+
+    struct SnapshotBuilder builder = {0};
+    build_config_snapshot(testcase_folder, test_case, &builder);
+    char snapshot_name[64];
+    snprintf(snapshot_name, sizeof(snapshot_name), "/chat-config-%d", test_case);
+    const struct ConfigSnapshot *config = publish_config_snapshot(snapshot_name, &builder);
+    /* Live statistics for stats.out; the moderator and the groups create it on first attach. */
+    char stats_name[64];
+    snprintf(stats_name, sizeof(stats_name), "/chat-stats-%d", test_case);
+    free(builder.data);
+
+    int n = config->n;
+    int app_groups_queue_key = config->app_groups_queue_key;
+    int moderator_groups_queue_key = config->moderator_groups_queue_key;
+
     int app_msgid = msgget(app_groups_queue_key, IPC_CREAT | 0666);
     if (app_msgid == -1) {
         fprintf(stderr, "Error creating app groups message queue (key: %d): %s\n",
@@ -71,18 +368,115 @@ int main(int argc, char *argv[]) {
     }
     printf("Successfully created app groups message queue (id: %d)\n", app_msgid);
 
-    int moderator_msgid = msgget(moderator_groups_queue_key, IPC_CREAT | 0666);
-    if (moderator_msgid == -1) {
-        fprintf(stderr, "Error creating moderator groups message queue (key: %d): %s\n",
-                moderator_groups_queue_key, strerror(errno));
-        exit(1);
+    /*
+     * MODERATOR_INSTANCES=k: app.out runs k moderator.out processes itself,
+     * instance i on its own queue (and bus) keyed moderator key plus
+     * i * MODERATOR_KEY_STRIDE; groups route each user to one of them by
+     * consistent hashing. Unset, a single moderator is started separately.
+     */
+    int instance_count = 1, managed_moderators = 0;
+    const char *instances_env = getenv("MODERATOR_INSTANCES");
+    if (instances_env != NULL) {
+        instance_count = atoi(instances_env);
+        if (instance_count < 1 || instance_count > MAX_MODERATORS) {
+            fprintf(stderr, "Invalid MODERATOR_INSTANCES=%s (expected 1..%d)\n", instances_env, MAX_MODERATORS);
+            exit(1);
+        }
+        managed_moderators = 1;
+        /*
+         * Nothing has attached the stats segment yet, so every instance
+         * starts from a fresh, zeroed one rather than one of them clearing
+         * counters the others may already be adding to.
+         */
+        shm_unlink(stats_name);
+    }
+
+    const char *transport = getenv("CHAT_TRANSPORT");
+    int use_bus = transport != NULL && strcmp(transport, "shm") == 0;
+    int moderator_msgids[MAX_MODERATORS];
+    int verdict_msgids[MAX_MODERATORS];
+    int query_msgids[MAX_MODERATORS];
+    int bus_shmids[MAX_MODERATORS];
+    for (int i = 0; i < instance_count; i++) {
+        int key = moderator_groups_queue_key + i * MODERATOR_KEY_STRIDE;
+        moderator_msgids[i] = msgget(key, IPC_CREAT | 0666);
+        if (moderator_msgids[i] == -1) {
+            fprintf(stderr, "Error creating moderator groups message queue (key: %d): %s\n",
+                    key, strerror(errno));
+            exit(1);
+        }
+        printf("Successfully created moderator message queue (id: %d)\n", moderator_msgids[i]);
+        /* Verdicts come back on a queue of their own; see moderator.c. */
+        verdict_msgids[i] = msgget(key + VERDICT_KEY_OFFSET, IPC_CREAT | 0666);
+        if (verdict_msgids[i] == -1) {
+            fprintf(stderr, "Error creating verdict message queue (key: %d): %s\n",
+                    key + VERDICT_KEY_OFFSET, strerror(errno));
+            exit(1);
+        }
+        /* And query.out talks to it on a third; see moderator.c. */
+        query_msgids[i] = msgget(key + QUERY_KEY_OFFSET, IPC_CREAT | 0666);
+        if (query_msgids[i] == -1) {
+            fprintf(stderr, "Error creating query message queue (key: %d): %s\n",
+                    key + QUERY_KEY_OFFSET, strerror(errno));
+            exit(1);
+        }
+        bus_shmids[i] = use_bus ? create_bus(key) : -1;
+    }
+
+    pid_t moderator_pids[MAX_MODERATORS];
+    if (managed_moderators) {
+        char count_str[12], test_case_str[12], instance_str[12];
+        snprintf(count_str, sizeof(count_str), "%d", instance_count);
+        snprintf(test_case_str, sizeof(test_case_str), "%d", test_case);
+        /* Persisted violation totals follow their users to the instance that now owns them. */
+        if (getenv("MODERATOR_STATE_DIR") != NULL) {
+            int status;
+            if (waitpid(spawn_moderator("--rebalance", count_str, NULL), &status, 0) == -1 ||
+                !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                fprintf(stderr, "Error rebalancing moderator state for %d instance(s)\n", instance_count);
+                exit(1);
+            }
+        }
+        for (int i = 0; i < instance_count; i++) {
+            snprintf(instance_str, sizeof(instance_str), "%d", i);
+            moderator_pids[i] = spawn_moderator(test_case_str, instance_str, count_str);
+        }
+        printf("Started %d moderator instance(s)\n", instance_count);
+    }
+
+    int pool_threads = 0;
+    const char *threads_env = getenv("GROUP_THREADS");
+    if (threads_env != NULL) {
+        pool_threads = atoi(threads_env);
+        if (pool_threads < 1) {
+            fprintf(stderr, "Invalid GROUP_THREADS=%s\n", threads_env);
+            exit(1);
+        }
+        if (run_group == NULL) {
+            fprintf(stderr, "GROUP_THREADS needs app.out linked with groups.c (-DGROUPS_NO_MAIN)\n");
+            exit(1);
+        }
+        if (pool_threads > n) {
+            pool_threads = n;
+        }
     }
-    printf("Successfully created moderator message queue (id: %d)\n", moderator_msgid);
 
     pid_t pids[MAX_GROUPS];
+    pthread_t pool_thread_ids[MAX_GROUPS];
+    struct GroupPool pool = {.test_case = test_case, .config = config, .next_group = 0};
     int active_groups = n;
 
-    for (int i = 0; i < n; i++) {
+    if (pool_threads > 0) {
+        printf("Running %d groups in-process on %d threads\n", n, pool_threads);
+        for (int i = 0; i < pool_threads; i++) {
+            if (pthread_create(&pool_thread_ids[i], NULL, group_pool_worker, &pool) != 0) {
+                fprintf(stderr, "Error starting group pool thread %d\n", i);
+                exit(1);
+            }
+        }
+    }
+
+    for (int i = 0; i < n && pool_threads == 0; i++) {
         pids[i] = fork();
         if (pids[i] == -1) {
             fprintf(stderr, "Fork failed for group %d: %s\n", i, strerror(errno));
@@ -106,7 +500,7 @@ int main(int argc, char *argv[]) {
     struct AppMessage msg;
     while (active_groups > 0) {
         printf("Waiting for message from groups...\n");
-        if (msgrcv(app_msgid, &msg, sizeof(msg.group_id), 0, 0) == -1) {
+        if (msgrcv(app_msgid, &msg, sizeof(msg) - sizeof(long), 0, 0) == -1) {
             if (errno == EINTR) {
                 printf("Interrupted while waiting for message. Retrying...\n");
                 continue;
@@ -120,21 +514,47 @@ int main(int argc, char *argv[]) {
     }
 
     printf("All groups have terminated. Waiting for child processes to finish...\n");
-    for (int i = 0; i < n; i++) {
+    for (int i = 0; i < pool_threads; i++) {
+        pthread_join(pool_thread_ids[i], NULL);
+    }
+    for (int i = 0; i < n && pool_threads == 0; i++) {
         waitpid(pids[i], NULL, 0);
         printf("Child process for group %d has finished\n", i);
     }
 
+    for (int i = 0; i < instance_count && managed_moderators; i++) {
+        stop_moderator_instance(moderator_msgids[i], bus_shmids[i]);
+        waitpid(moderator_pids[i], NULL, 0);
+        printf("Moderator instance %d has finished\n", i);
+    }
+
     printf("Removing message queues...\n");
     if (msgctl(app_msgid, IPC_RMID, NULL) == -1) {
         fprintf(stderr, "Error removing app message queue: %s\n", strerror(errno));
         exit(1);
     }
-    if (msgctl(moderator_msgid, IPC_RMID, NULL) == -1) {
-        fprintf(stderr, "Error removing moderator message queue: %s\n", strerror(errno));
-        exit(1);
+    for (int i = 0; i < instance_count; i++) {
+        if (msgctl(moderator_msgids[i], IPC_RMID, NULL) == -1) {
+            fprintf(stderr, "Error removing moderator message queue: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (msgctl(verdict_msgids[i], IPC_RMID, NULL) == -1) {
+            fprintf(stderr, "Error removing verdict message queue: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (msgctl(query_msgids[i], IPC_RMID, NULL) == -1) {
+            fprintf(stderr, "Error removing query message queue: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (bus_shmids[i] != -1 && shmctl(bus_shmids[i], IPC_RMID, NULL) == -1) {
+            fprintf(stderr, "Error removing shared message bus: %s\n", strerror(errno));
+            exit(1);
+        }
     }
 
+    shm_unlink(snapshot_name);
+    shm_unlink(stats_name);
+
     printf("App process completed successfully\n");
     return 0;
 }
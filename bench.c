@@ -0,0 +1,516 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <termios.h>
+#include <sys/msg.h>
+#include <sys/ipc.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+#define MAX_MESSAGE_LENGTH 256
+#define MAX_GROUPS 30
+#define READY_TIMEOUT_MS 5000
+#define DRAIN_QUIET_MS 500
+#define VERDICT_KEY_OFFSET 0x8000
+#define MODERATOR_PREFIX "Received message from group "
+
+typedef struct {
+    long mtype;
+    int timestamp;
+    int user;
+    char mtext[256];
+    int modifyingGroup;
+} Message;
+
+/*
+ * End-to-end benchmark: runs moderator.out and app.out (which starts the
+ * groups) against a testcase folder, standing in for the validator itself.
+ *
+ * Every message reaches the validation queue and, right after, the
+ * moderator. The stand-in validator timestamps the first, and the
+ * moderator's "Received message ..." line (read through a pseudo-terminal,
+ * so it is line-buffered and arrives as soon as it is printed) timestamps
+ * the second. Both are keyed by (group, user, text), and their difference
+ * is the group -> moderator latency reported below. Texts should be unique
+ * per user, as loadgen.out makes them.
+ *
+ * Run it from the repo root: it first brings app.out, groups.out and
+ * moderator.out up to date with make, so a run never measures stale
+ * binaries.
+ */
+
+/* Arrival times of one message on each side, keyed by a hash of (group, user, text). */
+struct Arrival {
+    unsigned long long key;
+    long long validator_ns;
+    long long moderator_ns;
+};
+
+struct ArrivalTable {
+    struct Arrival *slots;
+    size_t capacity;
+    size_t count;
+};
+
+struct Run {
+    int test_case;
+    int n;
+    int validation_queue_id;
+    int moderator_pty;
+    pid_t moderator_pid;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    long long moderator_ready_ns;
+    long long moderator_last_line_ns;
+    int moderator_done;
+    char moderator_error[256];
+
+    long long first_message_ns;
+    long long last_message_ns;
+    long messages;
+    int groups_done;
+    int removed_users;
+
+    struct ArrivalTable arrivals;
+    long long *latencies;
+    size_t latency_count;
+    size_t latency_capacity;
+};
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned long long arrival_key(int group, int user, const char *text, size_t len) {
+    unsigned long long h = 1469598103934665603ULL;
+    h = (h ^ (unsigned int)group) * 1099511628211ULL;
+    h = (h ^ (unsigned int)user) * 1099511628211ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)text[i]) * 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+static void *xrealloc(void *ptr, size_t size) {
+    void *p = realloc(ptr, size);
+    if (p == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static struct Arrival *arrival_slot(struct ArrivalTable *table, unsigned long long key) {
+    if (2 * (table->count + 1) > table->capacity) {
+        struct ArrivalTable grown = {.capacity = table->capacity ? table->capacity * 2 : 65536};
+        grown.slots = calloc(grown.capacity, sizeof(struct Arrival));
+        if (grown.slots == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < table->capacity; i++) {
+            if (table->slots[i].key != 0) {
+                size_t j = table->slots[i].key & (grown.capacity - 1);
+                while (grown.slots[j].key != 0) {
+                    j = (j + 1) & (grown.capacity - 1);
+                }
+                grown.slots[j] = table->slots[i];
+            }
+        }
+        grown.count = table->count;
+        free(table->slots);
+        *table = grown;
+    }
+    size_t i = key & (table->capacity - 1);
+    while (table->slots[i].key != 0 && table->slots[i].key != key) {
+        i = (i + 1) & (table->capacity - 1);
+    }
+    if (table->slots[i].key == 0) {
+        table->slots[i].key = key;
+        table->count++;
+    }
+    return &table->slots[i];
+}
+
+/* Records one side's arrival; once both sides are in, the difference is a latency sample. */
+static void record_arrival(struct Run *run, unsigned long long key, int from_moderator, long long t) {
+    pthread_mutex_lock(&run->lock);
+    struct Arrival *a = arrival_slot(&run->arrivals, key);
+    if (from_moderator) {
+        a->moderator_ns = t;
+    } else {
+        a->validator_ns = t;
+    }
+    if (a->moderator_ns != 0 && a->validator_ns != 0) {
+        long long latency = a->moderator_ns - a->validator_ns;
+        if (run->latency_count == run->latency_capacity) {
+            run->latency_capacity = run->latency_capacity ? run->latency_capacity * 2 : 65536;
+            run->latencies = xrealloc(run->latencies, run->latency_capacity * sizeof(long long));
+        }
+        /* The copies are sent back to back, so the moderator can print first. */
+        run->latencies[run->latency_count++] = latency > 0 ? latency : 0;
+        a->moderator_ns = a->validator_ns = 0;
+    }
+    pthread_mutex_unlock(&run->lock);
+}
+
+/* Stand-in validator: drains the validation queue until every group has ended. */
+static void *validator_thread(void *arg) {
+    struct Run *run = arg;
+    Message msg;
+    while (run->groups_done < run->n) {
+        if (msgrcv(run->validation_queue_id, &msg, sizeof(Message) - sizeof(long), 0, 0) == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error in validator msgrcv: %s\n", strerror(errno));
+            exit(1);
+        }
+        long long t = now_ns();
+        if (msg.mtype == 3) {
+            pthread_mutex_lock(&run->lock);
+            run->groups_done++;
+            run->removed_users += msg.user;
+            pthread_mutex_unlock(&run->lock);
+        } else if (msg.mtype >= MAX_GROUPS) {
+            if (run->messages == 0) {
+                run->first_message_ns = t;
+            }
+            run->last_message_ns = t;
+            run->messages++;
+            msg.mtext[sizeof(msg.mtext) - 1] = '\0';
+            record_arrival(run, arrival_key(msg.modifyingGroup, msg.user, msg.mtext, strlen(msg.mtext)), 0, t);
+        }
+    }
+    return NULL;
+}
+
+static void moderator_line(struct Run *run, const char *line, size_t len, long long t) {
+    size_t prefix = strlen(MODERATOR_PREFIX);
+    if (len >= prefix && memcmp(line, MODERATOR_PREFIX, prefix) == 0) {
+        int group, user, consumed;
+        if (sscanf(line + prefix, "%d, user %d: %n", &group, &user, &consumed) == 2) {
+            const char *text = line + prefix + consumed;
+            record_arrival(run, arrival_key(group, user, text, line + len - text), 1, t);
+        }
+    } else if (len > 5 && memcmp(line, "Error", 5) == 0) {
+        snprintf(run->moderator_error, sizeof(run->moderator_error), "%.*s", (int)len, line);
+    } else if (run->moderator_ready_ns == 0 && strncmp(line, "Waiting for message", 19) == 0) {
+        pthread_mutex_lock(&run->lock);
+        run->moderator_ready_ns = t;
+        pthread_cond_broadcast(&run->changed);
+        pthread_mutex_unlock(&run->lock);
+    }
+}
+
+/* Reads the moderator's terminal until it exits, splitting it into lines. */
+static void *moderator_reader(void *arg) {
+    struct Run *run = arg;
+    static char buffer[1 << 16];
+    size_t used = 0;
+    while (1) {
+        ssize_t got = read(run->moderator_pty, buffer + used, sizeof(buffer) - used);
+        if (got <= 0) {
+            if (got == -1 && errno == EINTR) continue;
+            break;
+        }
+        long long t = now_ns();
+        used += got;
+        char *p = buffer, *nl;
+        while ((nl = memchr(p, '\n', buffer + used - p)) != NULL) {
+            moderator_line(run, p, nl - p, t);
+            p = nl + 1;
+        }
+        used = buffer + used - p;
+        memmove(buffer, p, used);
+        if (used == sizeof(buffer)) {
+            used = 0;
+        }
+        pthread_mutex_lock(&run->lock);
+        run->moderator_last_line_ns = t;
+        pthread_mutex_unlock(&run->lock);
+    }
+    pthread_mutex_lock(&run->lock);
+    run->moderator_done = 1;
+    pthread_cond_broadcast(&run->changed);
+    pthread_mutex_unlock(&run->lock);
+    return NULL;
+}
+
+/* Starts moderator.out on a raw pseudo-terminal, so its stdout is line-buffered. */
+static void start_moderator(struct Run *run, const char *test_case_str) {
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+        fprintf(stderr, "Error creating pseudo-terminal: %s\n", strerror(errno));
+        exit(1);
+    }
+    fcntl(master, F_SETFD, FD_CLOEXEC);
+    const char *slave_name = ptsname(master);
+    pid_t pid = fork();
+    if (pid == -1) {
+        fprintf(stderr, "Error forking moderator: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (pid == 0) {
+        int slave = open(slave_name, O_RDWR | O_NOCTTY);
+        if (slave == -1) {
+            _exit(1);
+        }
+        struct termios raw;
+        tcgetattr(slave, &raw);
+        cfmakeraw(&raw);
+        tcsetattr(slave, TCSANOW, &raw);
+        dup2(slave, STDOUT_FILENO);
+        dup2(slave, STDERR_FILENO);
+        close(slave);
+        close(master);
+        /* Latencies come from the per-message trace lines. */
+        setenv("CHAT_LOG", "debug", 1);
+        execl("./moderator.out", "moderator.out", test_case_str, (char *)NULL);
+        _exit(127);
+    }
+    run->moderator_pty = master;
+    run->moderator_pid = pid;
+}
+
+static pid_t start_app(const char *test_case_str) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        fprintf(stderr, "Error forking app: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd != -1) {
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+        /* Own process group, so a failed run can stop the groups along with app.out. */
+        setpgid(0, 0);
+        /* bench.out runs and watches the one moderator itself. */
+        unsetenv("MODERATOR_INSTANCES");
+        execl("./app.out", "app.out", test_case_str, (char *)NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+/* Waits on run->changed until *flag is set or timeout_ms passes. */
+static int wait_for(struct Run *run, const long long *flag, long long timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&run->lock);
+    while (*flag == 0 && !run->moderator_done) {
+        if (pthread_cond_timedwait(&run->changed, &run->lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    int ok = *flag != 0;
+    pthread_mutex_unlock(&run->lock);
+    return ok;
+}
+
+static int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_ms(const long long *sorted, size_t count, double p) {
+    if (count == 0) {
+        return 0;
+    }
+    size_t i = (size_t)(p * (count - 1) + 0.5);
+    return sorted[i] / 1e6;
+}
+
+static int open_fresh_queue(int key) {
+    int stale = msgget(key, 0666);
+    if (stale != -1) {
+        msgctl(stale, IPC_RMID, NULL);
+    }
+    int id = msgget(key, IPC_CREAT | 0666);
+    if (id == -1) {
+        fprintf(stderr, "Error creating message queue (key: %d): %s\n", key, strerror(errno));
+        exit(1);
+    }
+    return id;
+}
+
+static void run_once(int test_case, int index) {
+    char path[512], test_case_str[32];
+    snprintf(test_case_str, sizeof(test_case_str), "%d", test_case);
+    snprintf(path, sizeof(path), "testcase_%d/input.txt", test_case);
+    FILE *input = fopen(path, "r");
+    if (input == NULL) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    struct Run run;
+    memset(&run, 0, sizeof(run));
+    int validation_key, app_key, moderator_key, threshold;
+    if (fscanf(input, "%d %d %d %d %d", &run.n, &validation_key, &app_key, &moderator_key, &threshold) != 5) {
+        fprintf(stderr, "Error reading from input.txt: Invalid format\n");
+        exit(1);
+    }
+    fclose(input);
+    run.test_case = test_case;
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.changed, NULL);
+
+    run.validation_queue_id = open_fresh_queue(validation_key);
+    /* moderator.out only opens its queue, so it has to exist before it starts. */
+    open_fresh_queue(moderator_key);
+    /* Verdicts left over from an aborted run would remove users from this one. */
+    open_fresh_queue(moderator_key + VERDICT_KEY_OFFSET);
+
+    pthread_t validator, reader;
+    pthread_create(&validator, NULL, validator_thread, &run);
+
+    /* With the shared-memory bus the ring is created by app.out, so it has to start first. */
+    const char *transport = getenv("CHAT_TRANSPORT");
+    int app_first = transport != NULL && strcmp(transport, "shm") == 0;
+    long long moderator_start_ns, app_start_ns = 0;
+    pid_t app_pid = 0;
+    if (app_first) {
+        app_start_ns = now_ns();
+        app_pid = start_app(test_case_str);
+        usleep(20000);
+    }
+    moderator_start_ns = now_ns();
+    start_moderator(&run, test_case_str);
+    pthread_create(&reader, NULL, moderator_reader, &run);
+    if (!wait_for(&run, &run.moderator_ready_ns, READY_TIMEOUT_MS)) {
+        fprintf(stderr, "moderator.out did not become ready\n");
+        kill(run.moderator_pid, SIGKILL);
+        exit(1);
+    }
+    if (!app_first) {
+        app_start_ns = now_ns();
+        app_pid = start_app(test_case_str);
+    }
+
+    struct rusage app_usage, moderator_usage;
+    int status;
+    while (wait4(app_pid, &status, WNOHANG, &app_usage) == 0) {
+        pthread_mutex_lock(&run.lock);
+        int moderator_gone = run.moderator_done;
+        pthread_mutex_unlock(&run.lock);
+        if (moderator_gone) {
+            /* Nothing will answer the groups any more; stop the run instead of hanging. */
+            fprintf(stderr, "moderator.out exited during the run%s%s\n",
+                    run.moderator_error[0] ? ": " : "", run.moderator_error);
+            kill(-app_pid, SIGKILL);
+            waitpid(app_pid, NULL, 0);
+            msgctl(run.validation_queue_id, IPC_RMID, NULL);
+            exit(1);
+        }
+        usleep(1000);
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "app.out failed\n");
+    }
+    long long app_end_ns = now_ns();
+    pthread_join(validator, NULL);
+
+    /* The moderator exits when app.out removes its queue; with the bus it has to be stopped. */
+    while (1) {
+        pthread_mutex_lock(&run.lock);
+        int done = run.moderator_done;
+        long long quiet = now_ns() - run.moderator_last_line_ns;
+        pthread_mutex_unlock(&run.lock);
+        if (done) {
+            break;
+        }
+        if (quiet > DRAIN_QUIET_MS * 1000000LL) {
+            kill(run.moderator_pid, SIGTERM);
+            break;
+        }
+        usleep(10000);
+    }
+    wait4(run.moderator_pid, &status, 0, &moderator_usage);
+    pthread_join(reader, NULL);
+    close(run.moderator_pty);
+    msgctl(run.validation_queue_id, IPC_RMID, NULL);
+
+    qsort(run.latencies, run.latency_count, sizeof(long long), compare_ll);
+    double span_s = (run.last_message_ns - run.first_message_ns) / 1e9;
+    printf("Run %d: testcase_%d, %d groups, %ld messages, %d users reported removed\n",
+           index, test_case, run.n, run.messages, run.removed_users);
+    printf("  startup:    moderator ready %.2f ms, first message %.2f ms after app start\n",
+           (run.moderator_ready_ns - moderator_start_ns) / 1e6,
+           run.messages ? (run.first_message_ns - app_start_ns) / 1e6 : 0.0);
+    printf("  throughput: %.0f msgs/sec (%.2f ms from first to last message, app %.2f ms total)\n",
+           span_s > 0 ? run.messages / span_s : 0.0, span_s * 1e3, (app_end_ns - app_start_ns) / 1e6);
+    printf("  latency:    p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms (%zu matched)\n",
+           percentile_ms(run.latencies, run.latency_count, 0.50),
+           percentile_ms(run.latencies, run.latency_count, 0.90),
+           percentile_ms(run.latencies, run.latency_count, 0.99),
+           percentile_ms(run.latencies, run.latency_count, 0.999),
+           percentile_ms(run.latencies, run.latency_count, 1.0),
+           run.latency_count);
+    printf("  peak RSS:   app+groups %ld KB, moderator %ld KB\n", app_usage.ru_maxrss, moderator_usage.ru_maxrss);
+
+    free(run.latencies);
+    free(run.arrivals.slots);
+}
+
+/* Runs make for the programs the benchmark starts; without a Makefile they have to be built already. */
+static void build_programs(void) {
+    static const char *programs[] = {"app.out", "groups.out", "moderator.out"};
+    if (access("Makefile", F_OK) == 0) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            fprintf(stderr, "Error forking: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (pid == 0) {
+            execlp("make", "make", "-s", programs[0], programs[1], programs[2], (char *)NULL);
+            fprintf(stderr, "Error running make: %s\n", strerror(errno));
+            _exit(127);
+        }
+        int status;
+        if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "Building the benchmarked programs failed\n");
+            exit(1);
+        }
+    }
+    for (size_t i = 0; i < sizeof(programs) / sizeof(programs[0]); i++) {
+        if (access(programs[i], X_OK) == -1) {
+            fprintf(stderr, "%s not found: run bench.out from the repo root (see Makefile)\n", programs[i]);
+            exit(1);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s <test_case_number> [runs]\n", argv[0]);
+        exit(1);
+    }
+    int test_case = atoi(argv[1]);
+    int runs = argc == 3 ? atoi(argv[2]) : 1;
+    if (runs < 1) {
+        fprintf(stderr, "Invalid number of runs: %s\n", argv[2]);
+        exit(1);
+    }
+    build_programs();
+    for (int i = 1; i <= runs; i++) {
+        run_once(test_case, i);
+    }
+    return 0;
+}
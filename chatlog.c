@@ -0,0 +1,208 @@
+/*
+ * Asynchronous log shared by groups.c and moderator.c, which include this
+ * file after defining MAX_MESSAGE_LENGTH (the way parser_fuzz.c includes
+ * groups.c), so each program is still built from its one .c file.
+ *
+ * CHAT_LOG=off|info|debug, default info. Workers never format or touch
+ * stdout: log_event() copies the format pointer, up to LOG_MAX_ARGS
+ * integers and one %s text into the next slot of an in-process ring,
+ * claimed and published like the shared bus. log_writer() formats the
+ * records in order and writes them out in large chunks. Lines above the
+ * configured level are dropped by a single comparison at the call site, so
+ * the per-message debug lines cost nothing unless CHAT_LOG=debug. When the
+ * ring is full, producers wait for the writer rather than drop lines, so a
+ * debug trace is always complete.
+ */
+#define LOG_RING_SLOTS 4096
+#define LOG_MAX_ARGS 4
+#define LOG_BUFFER_SIZE 65536
+#define LOG_LINE_MAX 1024
+#define LOG_OFF 0
+#define LOG_INFO 1
+#define LOG_DEBUG 2
+
+struct LogRecord {
+    unsigned int seq;
+    unsigned short text_len;
+    const char *format;
+    long long args[LOG_MAX_ARGS];
+    char text[MAX_MESSAGE_LENGTH];
+};
+
+struct LogRing {
+    unsigned int head;
+    char head_pad[60];
+    unsigned int tail;
+    char tail_pad[60];
+    /* Everything before written has reached stdout. */
+    unsigned int written;
+    unsigned int writer_waiting;
+    unsigned int producers_waiting;
+    unsigned int flushers_waiting;
+    struct LogRecord slots[LOG_RING_SLOTS];
+};
+
+/* Process-wide: in the in-process runtime every group logs through one ring. */
+int log_level = LOG_INFO;
+int log_started;
+struct LogRing log_ring;
+pthread_once_t logger_once = PTHREAD_ONCE_INIT;
+
+static long log_futex(unsigned int *addr, int op, unsigned int val) {
+    return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+#define log_event(level, format, text, ...) \
+    do { \
+        if ((level) <= log_level) { \
+            long long log_args_[] = {__VA_ARGS__}; \
+            log_append(format, text, log_args_, sizeof(log_args_) / sizeof(log_args_[0])); \
+        } \
+    } while (0)
+
+/* Queues one line for log_writer(); only blocks while the ring is a full lap ahead. */
+void log_append(const char *format, const char *text, const long long *args, int count) {
+    unsigned int pos = __atomic_fetch_add(&log_ring.tail, 1, __ATOMIC_RELAXED);
+    while (1) {
+        unsigned int head = __atomic_load_n(&log_ring.head, __ATOMIC_ACQUIRE);
+        if (pos - head < LOG_RING_SLOTS) {
+            break;
+        }
+        __atomic_add_fetch(&log_ring.producers_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&log_ring.head, __ATOMIC_SEQ_CST) == head) {
+            log_futex(&log_ring.head, FUTEX_WAIT, head);
+        }
+        __atomic_sub_fetch(&log_ring.producers_waiting, 1, __ATOMIC_SEQ_CST);
+    }
+    struct LogRecord *record = &log_ring.slots[pos % LOG_RING_SLOTS];
+    record->format = format;
+    for (int i = 0; i < count && i < LOG_MAX_ARGS; i++) {
+        record->args[i] = args[i];
+    }
+    record->text_len = 0;
+    if (text != NULL) {
+        record->text_len = strnlen(text, MAX_MESSAGE_LENGTH);
+        memcpy(record->text, text, record->text_len);
+    }
+    __atomic_store_n(&record->seq, pos + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&log_ring.writer_waiting, __ATOMIC_SEQ_CST)) {
+        log_futex(&record->seq, FUTEX_WAKE, 1);
+    }
+}
+
+/* Expands %d, %zu and %s (the record's text); formats are literals from the callers. */
+static size_t format_log_record(char *out, const struct LogRecord *record) {
+    char *p = out;
+    int arg = 0;
+    for (const char *f = record->format; *f != '\0'; f++) {
+        if (*f != '%') {
+            *p++ = *f;
+            continue;
+        }
+        if (*++f == 'z') {
+            f++;
+        }
+        if (*f == 'd' && arg < LOG_MAX_ARGS) {
+            p += sprintf(p, "%lld", record->args[arg++]);
+        } else if (*f == 'u' && arg < LOG_MAX_ARGS) {
+            p += sprintf(p, "%llu", (unsigned long long)record->args[arg++]);
+        } else if (*f == 's') {
+            memcpy(p, record->text, record->text_len);
+            p += record->text_len;
+        } else if (*f == '\0') {
+            break;
+        } else {
+            *p++ = *f;
+        }
+    }
+    return p - out;
+}
+
+static void log_write_out(const char *out, size_t used) {
+    fwrite(out, 1, used, stdout);
+    fflush(stdout);
+    __atomic_store_n(&log_ring.written, log_ring.head, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&log_ring.flushers_waiting, __ATOMIC_SEQ_CST)) {
+        log_futex(&log_ring.written, FUTEX_WAKE, 0x7fffffff);
+    }
+}
+
+void *log_writer(void *arg) {
+    (void)arg;
+    static char out[LOG_BUFFER_SIZE];
+    size_t used = 0;
+    while (1) {
+        unsigned int pos = log_ring.head;
+        struct LogRecord *record = &log_ring.slots[pos % LOG_RING_SLOTS];
+        unsigned int seq = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos + 1) {
+            if (LOG_BUFFER_SIZE - used < LOG_LINE_MAX) {
+                log_write_out(out, used);
+                used = 0;
+            }
+            used += format_log_record(out + used, record);
+            __atomic_store_n(&log_ring.head, pos + 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&log_ring.producers_waiting, __ATOMIC_SEQ_CST)) {
+                log_futex(&log_ring.head, FUTEX_WAKE, 0x7fffffff);
+            }
+            continue;
+        }
+        /* Caught up: hand the formatted lines to stdout before sleeping. */
+        if (used > 0) {
+            log_write_out(out, used);
+            used = 0;
+        }
+        __atomic_store_n(&log_ring.writer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&record->seq, __ATOMIC_SEQ_CST) == seq) {
+            log_futex(&record->seq, FUTEX_WAIT, seq);
+        }
+        __atomic_store_n(&log_ring.writer_waiting, 0, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+/* Waits until every line queued so far is on stdout; also runs at exit. */
+void log_flush(void) {
+    if (!log_started) {
+        return;
+    }
+    unsigned int target = __atomic_load_n(&log_ring.tail, __ATOMIC_ACQUIRE);
+    while (1) {
+        unsigned int written = __atomic_load_n(&log_ring.written, __ATOMIC_ACQUIRE);
+        if ((int)(written - target) >= 0) {
+            break;
+        }
+        __atomic_add_fetch(&log_ring.flushers_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&log_ring.written, __ATOMIC_SEQ_CST) == written) {
+            log_futex(&log_ring.written, FUTEX_WAIT, written);
+        }
+        __atomic_sub_fetch(&log_ring.flushers_waiting, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void start_logger(void) {
+    const char *level = getenv("CHAT_LOG");
+    if (level != NULL) {
+        if (strcmp(level, "off") == 0) {
+            log_level = LOG_OFF;
+        } else if (strcmp(level, "info") == 0) {
+            log_level = LOG_INFO;
+        } else if (strcmp(level, "debug") == 0) {
+            log_level = LOG_DEBUG;
+        } else {
+            fprintf(stderr, "Invalid CHAT_LOG=%s (expected off, info or debug)\n", level);
+            exit(1);
+        }
+    }
+    if (log_level == LOG_OFF) {
+        return;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, log_writer, NULL) != 0) {
+        fprintf(stderr, "Error creating log writer thread\n");
+        exit(1);
+    }
+    pthread_detach(thread);
+    log_started = 1;
+    atexit(log_flush);
+}
@@ -8,12 +8,55 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
+#include <sys/shm.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <limits.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define MAX_USERS 50
 #define MAX_MESSAGE_LENGTH 256
 #define MAX_NUMBER_OF_GROUPS 30
 #define MAX_GROUPS 30
 #define MAX_TIMESTAMP 2147000000
+#define BUS_RING_SLOTS 4096
+#define MAX_EVENTS 64
+#define READS_PER_WAKEUP 16
+#define READ_CHUNK_SIZE 65536
+#define FRAME_LINES_BATCH 256
+#define GROUP_MERGE_LOOKAHEAD 256
+#define GROUP_MERGE_IDLE_MS 50
+#define MAX_LINE_LENGTH (2 * MAX_MESSAGE_LENGTH)
+#define BATCH_MTYPE_BASE (2 * MAX_NUMBER_OF_GROUPS)
+#define BATCH_FRAME_BYTES 8192
+#define BATCH_ACK_USER -1
+#define BATCH_FLUSH_MS 2
+#define MAX_MODERATORS 8
+#define MODERATOR_KEY_STRIDE 0x10000
+#define VERDICT_KEY_OFFSET 0x8000
+#define VERDICT_MTYPE_BASE 1
+#define VERDICT_CLOSE_USER -2
+#define VERDICT_CLOSE_TIMEOUT_MS 5000
+#define OUTBOX_RETRY_MS 1
+#define CONFIG_SNAPSHOT_MAGIC 0x47464343
+#define CONFIG_SNAPSHOT_VERSION 1
+#define TRACE_MAGIC 0x45435254
+#define TRACE_VERSION 1
+#define TRACE_BUFFER_SIZE (1 << 20)
+#define STATS_MAGIC 0x54534843
+#define STATS_VERSION 3
+#define STATS_BUCKETS 256
 
 typedef struct {
     long mtype;
@@ -23,200 +66,1766 @@ typedef struct {
     int modifyingGroup;
 } Message;
 
+/*
+ * Batched moderator frame (mtype BATCH_MTYPE_BASE + group): count records,
+ * each a BatchRecordHeader followed by len bytes of text without a NUL.
+ * Only used once the moderator has acknowledged the format; see
+ * moderator.c.
+ */
+struct BatchRecordHeader {
+    int timestamp;
+    int user;
+    unsigned short len;
+} __attribute__((packed));
+
+struct BatchFrame {
+    long mtype;
+    int group;
+    int count;
+    char data[BATCH_FRAME_BYTES];
+};
+
+/*
+ * Shared group -> moderator ring (CHAT_TRANSPORT=shm), created by app.c.
+ * Producers claim a position with an atomic increment on tail, fill the slot
+ * in place and publish it by storing seq = position + 1. The moderator
+ * consumes in position order and advances head. Both sides sleep on futexes
+ * in the segment only when the ring is empty or full.
+ */
+struct BusSlot {
+    unsigned int seq;
+    Message msg;
+};
+
+struct BusRing {
+    unsigned int head;
+    char head_pad[60];
+    unsigned int tail;
+    char tail_pad[60];
+    unsigned int consumer_waiting;
+    unsigned int producers_waiting;
+    char wait_pad[56];
+    struct BusSlot slots[BUS_RING_SLOTS];
+};
+
+/* A parsed line waiting in a user's lookahead. */
+struct PendingLine {
+    int timestamp;
+    int len;
+    long long parsed_ns;
+    char text[MAX_MESSAGE_LENGTH];
+};
+
+/*
+ * users[] is a slot map: a user keeps its slot for its whole lifetime and
+ * removal just frees the slot. The id handed to the validator and moderator
+ * is generation * MAX_USERS + slot, so ids stay stable and a verdict for a
+ * removed user can never hit whoever takes the slot next. The first user in
+ * each slot has generation 0, i.e. id == slot.
+ */
 struct User {
     int id;
+    int active;
+    unsigned int generation;
     int pipe_fd[2];
     pid_t pid;
+    /* Unterminated tail of the last read; bytes past MAX_LINE_LENGTH are dropped. */
+    char partial[MAX_LINE_LENGTH];
+    int partial_len;
+    /* GROUP_INGEST=mmap: the user file mapped in place of a writer process. */
+    int mapped;
+    const char *map;
+    size_t map_len;
+    size_t map_pos;
+    /*
+     * Ordering stage: lines parsed but not yet sent, oldest first, and the
+     * user's position in the merge heap while there are any. ended is set
+     * at end of input; the user leaves once its lines are sent. A pipe
+     * user whose lookahead is full stops reading (stalled) and keeps the
+     * unframed rest of its last read in overflow.
+     */
+    struct PendingLine *pending;
+    int pending_head;
+    int pending_count;
+    int heap_index;
+    int ended;
+    int stalled;
+    /* When the user last delivered a line; a user quiet for GROUP_MERGE_IDLE_MS stops holding others back. */
+    long long heard_ns;
+    char *overflow;
+    size_t overflow_len;
+    size_t overflow_pos;
+    long long overflow_read_ns;
+};
+
+/* What an fd registered with the group's epoll instance stands for. */
+enum FdKind {
+    FD_UNUSED,
+    FD_USER_PIPE,
+    FD_CHILD,
+    FD_VERDICT,
+    FD_SIGCHLD
+};
+
+struct FdEntry {
+    enum FdKind kind;
+    int user_index;
+    pid_t pid;
+    int ready;
 };
 struct AppMessage {
     long mtype;
     int group_id;
 };
-int group_id, validation_queue_key, app_groups_queue_key, moderator_groups_queue_key;
-int validation_queue_id, app_groups_queue_id, moderator_groups_queue_id;
-struct User users[MAX_USERS];
-int user_count = 0;
-int removed_users = 0;
 
-void send_validation_message(int mtype, int user) {
-    Message msg = {.mtype = mtype, .modifyingGroup = group_id, .user = user};
-    if (msgsnd(validation_queue_id, &msg, sizeof(Message) - sizeof(long), 0) == -1) {
-        fprintf(stderr, "Error sending validation message: %s\n", strerror(errno));
-        exit(1);
+#include "chatlog.c"
+
+/*
+ * Pre-parsed configuration published by app.c as /chat-config-<test_case>;
+ * see app.c for the format. Layout must match app.c.
+ */
+struct ConfigSnapshotGroup {
+    unsigned int path;
+    int user_count;
+    unsigned int users;
+};
+
+struct ConfigSnapshot {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int size;
+    int test_case;
+    unsigned long long input_dev;
+    unsigned long long input_ino;
+    long long input_size;
+    long long input_mtime_ns;
+    int n;
+    int validation_queue_key;
+    int app_groups_queue_key;
+    int moderator_groups_queue_key;
+    int threshold;
+    struct ConfigSnapshotGroup groups[MAX_GROUPS];
+};
+
+/* input.txt as parsed directly, when no usable snapshot is published. */
+struct ChatConfig {
+    int n;
+    int validation_queue_key;
+    int app_groups_queue_key;
+    int moderator_groups_queue_key;
+    int threshold;
+    char group_paths[MAX_GROUPS][256];
+};
+
+/*
+ * Live statistics, published in the POSIX shared-memory object
+ * /chat-stats-<test_case> and read by stats.out. Each group owns its
+ * GroupStats slot and the moderator owns the rest; every field has a
+ * single writer and is updated with relaxed atomics, so readers never
+ * block the pipeline and at worst see a sample that is one update old.
+ * Latencies are HDR-style log-linear histograms in nanoseconds: values
+ * below 8 get a bucket each, then every power of two is split into 8
+ * buckets, up to about 17 s. Layout must match groups.c, moderator.c
+ * and stats.c.
+ */
+struct LatencyHistogram {
+    unsigned long long count;
+    unsigned long long sum_ns;
+    unsigned long long max_ns;
+    unsigned long long buckets[STATS_BUCKETS];
+};
+
+struct GroupStats {
+    int active;
+    int pid;
+    unsigned long long bytes_read;
+    unsigned long long lines;
+    unsigned long long parse_errors;
+    unsigned long long messages_sent;
+    unsigned long long verdicts;
+    unsigned long long users_removed;
+    unsigned long long throttled_sends;
+    struct LatencyHistogram read_to_parse;
+    struct LatencyHistogram parse_to_send;
+    struct LatencyHistogram verdict_to_remove;
+};
+
+/*
+ * GROUP_TRACE=<dir> records every message the group sends to the moderator
+ * in <dir>/group_<id>.trace: a TraceHeader, then per message, in send
+ * order, a TraceRecord followed by len bytes of text without a NUL.
+ * sent_ns is CLOCK_MONOTONIC, so the traces of one run share a clock and
+ * replay.out can interleave them. Layout must match replay.c.
+ */
+struct TraceHeader {
+    unsigned int magic;
+    unsigned int version;
+    int group;
+    int reserved;
+};
+
+struct TraceRecord {
+    long long sent_ns;
+    int timestamp;
+    int user;
+    unsigned short len;
+} __attribute__((packed));
+
+struct ModeratorGroupStats {
+    unsigned long long received;
+    unsigned long long duplicates;
+    unsigned long long violations;
+    unsigned long long removals;
+    struct LatencyHistogram receive_to_verdict;
+};
+
+struct QueueDepth {
+    unsigned long long messages;
+    unsigned long long bytes;
+    unsigned long long max_messages;
+};
+
+struct StatsSegment {
+    unsigned int magic;
+    unsigned int version;
+    struct GroupStats groups[MAX_GROUPS];
+    int moderator_pid;
+    int moderator_active;
+    unsigned long long sampled_ns;
+    struct QueueDepth moderator_queue;
+    struct QueueDepth validation_queue;
+    struct QueueDepth bus;
+    struct QueueDepth verdict_queue;
+    struct ModeratorGroupStats moderator[MAX_GROUPS];
+};
+
+/* A verdict and when the moderator sent it (CLOCK_MONOTONIC microseconds, low 32 bits). */
+struct PendingVerdict {
+    int user;
+    unsigned int sent_us;
+};
+
+/* Verdicts picked up by the listener threads, waiting for the group loop. */
+struct VerdictInbox {
+    long mtype;
+    int event_fd;
+    pthread_mutex_t lock;
+    struct PendingVerdict *pending;
+    int count;
+    int capacity;
+    int running;
+};
+
+/*
+ * Messages a System V queue had no room for, waiting to be retried in order:
+ * entries of a size_t message size and the message, 8-byte aligned.
+ */
+struct Outbox {
+    char *data;
+    size_t head;
+    size_t used;
+    size_t capacity;
+};
+
+/*
+ * One moderator instance (MODERATOR_INSTANCES; see app.c): its queue, its
+ * shared bus with CHAT_TRANSPORT=shm, the batch being filled for it, the
+ * sends its queue had no room for, and the thread that takes its verdicts
+ * off the instance's verdict queue (see moderator.c).
+ */
+struct ModeratorLink {
+    int queue_id;
+    int verdict_queue_id;
+    struct BusRing *bus;
+    struct BatchFrame batch;
+    size_t batch_used;
+    long long batch_deadline_ms;
+    /* Set once this moderator acknowledges batched frames. */
+    int batching_enabled;
+    struct Outbox outbox;
+    pthread_t listener;
+    struct VerdictInbox *inbox;
+    /* Set by the listener once the moderator has echoed the group's close. */
+    int closed;
+};
+
+/*
+ * Per-group state. It is thread-local so that app.c can run several groups
+ * in one process (GROUP_THREADS), one per pool thread at a time; in a
+ * groups.out process there is just the one.
+ */
+__thread int group_id, validation_queue_key, app_groups_queue_key, moderator_groups_queue_key;
+__thread int validation_queue_id, app_groups_queue_id;
+__thread struct ModeratorLink moderators[MAX_MODERATORS];
+__thread int moderator_count = 1;
+__thread int in_process = 0;
+/* Validation gets its copies through an outbox of its own. */
+__thread struct Outbox validation_outbox;
+/* Some queue was full; user input waits until the outboxes drain. */
+__thread int throttled = 0;
+
+__thread int epoll_fd = -1;
+__thread struct FdEntry *fd_table = NULL;
+__thread int fd_table_size = 0;
+__thread int live_children = 0;
+__thread int sigchld_fd = -1;
+
+/* User pipes that used up their read budget and still have data pending. */
+__thread int ready_fds[MAX_USERS];
+__thread int ready_count = 0;
+
+__thread struct VerdictInbox inbox;
+
+__thread size_t batch_limit = BATCH_FRAME_BYTES;
+__thread struct User users[MAX_USERS];
+__thread int user_count = 0;
+__thread int free_slots[MAX_USERS];
+__thread int free_slot_count = 0;
+__thread int slots_used = 0;
+__thread int ingest_mapped = 0;
+/*
+ * Ordering stage (GROUP_MERGE=on, off by default): a min-heap of users keyed by
+ * the timestamp of their oldest pending line. See merge_release().
+ */
+__thread int merge_enabled = 0;
+__thread int merge_lookahead = GROUP_MERGE_LOOKAHEAD;
+__thread long long merge_lateness = -1;
+__thread long long merge_idle_ns = GROUP_MERGE_IDLE_MS * 1000000LL;
+/* Time spent throttled is not idleness: users are not read then. */
+__thread long long merge_resumed_ns = 0;
+/* How long the event loop may sleep before an idle user has to be let go, or -1. */
+__thread int merge_wait_ms = -1;
+__thread int merge_newest = 0;
+__thread int merge_heap[MAX_USERS];
+__thread int merge_heap_size = 0;
+__thread int mapped_users = 0;
+__thread int removed_users = 0;
+__thread struct StatsSegment *stats_segment = NULL;
+__thread struct GroupStats *stats = NULL;
+/* When the chunk now being framed was read; lines inherit it. */
+__thread long long chunk_read_ns = 0;
+__thread FILE *trace_file = NULL;
+__thread char trace_path[512];
+__thread long trace_records = 0;
+
+static long long stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Single-writer counters: a relaxed load and store, no locked instruction. */
+static void stat_add(unsigned long long *counter, unsigned long long value) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static int stats_bucket(unsigned long long ns) {
+    if (ns < 8) {
+        return ns;
+    }
+    int e = 63 - __builtin_clzll(ns);
+    int bucket = (e - 2) * 8 + (int)((ns >> (e - 3)) & 7);
+    return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+static void stats_record(struct LatencyHistogram *h, long long ns) {
+    if (ns < 0) {
+        ns = 0;
+    }
+    stat_add(&h->count, 1);
+    stat_add(&h->sum_ns, ns);
+    stat_add(&h->buckets[stats_bucket(ns)], 1);
+    if ((unsigned long long)ns > __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&h->max_ns, ns, __ATOMIC_RELAXED);
+    }
+}
+
+/* Maps /chat-stats-<test_case>, creating it if needed; NULL disables stats. */
+static struct StatsSegment *attach_stats(int test_case) {
+    const char *setting = getenv("CHAT_STATS");
+    if (setting != NULL && strcmp(setting, "off") == 0) {
+        return NULL;
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "/chat-stats-%d", test_case);
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0666);
+    if (fd == -1) {
+        fprintf(stderr, "Stats disabled: cannot open %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (st.st_size < (off_t)sizeof(struct StatsSegment) &&
+                                 ftruncate(fd, sizeof(struct StatsSegment)) == -1)) {
+        fprintf(stderr, "Stats disabled: cannot size %s: %s\n", name, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    struct StatsSegment *segment = mmap(NULL, sizeof(struct StatsSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        fprintf(stderr, "Stats disabled: cannot map %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+    /* Every writer stores the same values, so racing first attaches are harmless. */
+    __atomic_store_n(&segment->version, STATS_VERSION, __ATOMIC_RELAXED);
+    __atomic_store_n(&segment->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+    return segment;
+}
+
+/*
+ * Which of count moderator instances owns (group, user): jump consistent
+ * hashing (Lamping and Veach) of the pair, so going from n to n + 1
+ * instances only moves the users that now belong to the new one. Must
+ * match moderator.c.
+ */
+int instance_of(int group_id, int user_id, int count) {
+    unsigned long long key = ((unsigned long long)(unsigned int)group_id << 32) | (unsigned int)user_id;
+    long long bucket = -1, next = 0;
+    while (next < count) {
+        bucket = next;
+        key = key * 2862933555777941757ULL + 1;
+        next = (long long)((bucket + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+    }
+    return (int)bucket;
+}
+
+/* The moderator instance that scores this group's messages from user. */
+static struct ModeratorLink *moderator_for(int user) {
+    if (moderator_count == 1) {
+        return &moderators[0];
+    }
+    return &moderators[instance_of(group_id, user, moderator_count)];
+}
+
+static long futex(unsigned int *addr, int op, unsigned int val) {
+    return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+
+void send_to_validation(const Message *msg);
+
+void send_validation_message(int mtype, int user) {
+    Message msg = {.mtype = mtype, .modifyingGroup = group_id, .user = user};
+    send_to_validation(&msg);
+    log_event(LOG_INFO, "Sent validation message: type=%d, group=%d, user=%d\n", NULL, mtype, group_id, user);
+}
+
+void attach_bus(struct ModeratorLink *link, int key) {
+    int shmid = shmget(key, sizeof(struct BusRing), 0666);
+    if (shmid == -1) {
+        fprintf(stderr, "Error connecting to shared message bus: %s\n", strerror(errno));
+        exit(1);
+    }
+    link->bus = shmat(shmid, NULL, 0);
+    if (link->bus == (void *)-1) {
+        fprintf(stderr, "Error attaching shared message bus: %s\n", strerror(errno));
+        exit(1);
+    }
+    printf("Attached to shared message bus (id: %d)\n", shmid);
+}
+
+/* Claims the next ring slot, waiting while the moderator is a full lap behind. */
+struct BusSlot *bus_claim(struct BusRing *bus) {
+    unsigned int pos = __atomic_fetch_add(&bus->tail, 1, __ATOMIC_RELAXED);
+    while (1) {
+        unsigned int head = __atomic_load_n(&bus->head, __ATOMIC_ACQUIRE);
+        if (pos - head < BUS_RING_SLOTS) {
+            break;
+        }
+        __atomic_add_fetch(&bus->producers_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&bus->head, __ATOMIC_SEQ_CST) == head) {
+            futex(&bus->head, FUTEX_WAIT, head);
+        }
+        __atomic_sub_fetch(&bus->producers_waiting, 1, __ATOMIC_SEQ_CST);
+    }
+    struct BusSlot *slot = &bus->slots[pos % BUS_RING_SLOTS];
+    slot->seq = pos;
+    return slot;
+}
+
+void bus_publish(struct BusRing *bus, struct BusSlot *slot) {
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&bus->consumer_waiting, __ATOMIC_SEQ_CST)) {
+        futex(&slot->seq, FUTEX_WAKE, 1);
+    }
+}
+
+static struct FdEntry *fd_entry(int fd) {
+    if (fd >= fd_table_size) {
+        int size = fd_table_size ? fd_table_size : 64;
+        while (size <= fd) size *= 2;
+        fd_table = realloc(fd_table, size * sizeof(struct FdEntry));
+        if (fd_table == NULL) {
+            fprintf(stderr, "Out of memory growing fd table\n");
+            exit(1);
+        }
+        memset(&fd_table[fd_table_size], 0, (size - fd_table_size) * sizeof(struct FdEntry));
+        fd_table_size = size;
+    }
+    return &fd_table[fd];
+}
+
+static void watch_fd(int fd, enum FdKind kind, int user_index, pid_t pid) {
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLET, .data.fd = fd};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        fprintf(stderr, "Error adding fd %d to epoll: %s\n", fd, strerror(errno));
+        exit(1);
+    }
+    struct FdEntry *entry = fd_entry(fd);
+    entry->kind = kind;
+    entry->user_index = user_index;
+    entry->pid = pid;
+    entry->ready = 0;
+}
+
+static void unwatch_fd(int fd) {
+    /* Children may still hold copies of the fd, so close() alone would not deregister it. */
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    struct FdEntry *entry = fd_entry(fd);
+    entry->kind = FD_UNUSED;
+    if (entry->ready) {
+        for (int i = 0; i < ready_count; i++) {
+            if (ready_fds[i] == fd) {
+                ready_fds[i] = ready_fds[--ready_count];
+                break;
+            }
+        }
+        entry->ready = 0;
+    }
+    close(fd);
+}
+
+void init_event_loop(void) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        fprintf(stderr, "Error creating epoll instance: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    /*
+     * Children are reaped from the loop: through a pidfd per child when the
+     * kernel supports it, otherwise through a signalfd for SIGCHLD. Blocking
+     * SIGCHLD first keeps exits that happen before the loop starts pending.
+     */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    int probe = syscall(SYS_pidfd_open, getpid(), 0);
+    if (probe != -1) {
+        close(probe);
+        return;
+    }
+    if (in_process && !ingest_mapped) {
+        /* waitpid(-1) would reap other groups' children. */
+        fprintf(stderr, "Group %d: running in-process needs pidfd support or GROUP_INGEST=mmap\n", group_id);
+        exit(1);
+    }
+    sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigchld_fd == -1) {
+        fprintf(stderr, "Error creating SIGCHLD signalfd: %s\n", strerror(errno));
+        exit(1);
+    }
+    watch_fd(sigchld_fd, FD_SIGCHLD, -1, 0);
+}
+
+static int alloc_user_slot(void) {
+    if (free_slot_count > 0) {
+        return free_slots[--free_slot_count];
+    }
+    if (slots_used < MAX_USERS) {
+        return slots_used++;
+    }
+    return -1;
+}
+
+/* Maps a user id back to its slot, or -1 if that user is no longer in the group. */
+int find_user(int id) {
+    if (id < 0) {
+        return -1;
+    }
+    int slot = id % MAX_USERS;
+    if (!users[slot].active || users[slot].id != id) {
+        return -1;
+    }
+    return slot;
+}
+
+static int merge_before(int a, int b) {
+    int ta = users[a].pending[users[a].pending_head].timestamp;
+    int tb = users[b].pending[users[b].pending_head].timestamp;
+    return ta < tb || (ta == tb && a < b);
+}
+
+static void merge_heap_swap(int i, int j) {
+    int a = merge_heap[i], b = merge_heap[j];
+    merge_heap[i] = b;
+    merge_heap[j] = a;
+    users[b].heap_index = i;
+    users[a].heap_index = j;
+}
+
+static void merge_heap_up(int i) {
+    while (i > 0 && merge_before(merge_heap[i], merge_heap[(i - 1) / 2])) {
+        merge_heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void merge_heap_down(int i) {
+    while (1) {
+        int least = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < merge_heap_size && merge_before(merge_heap[left], merge_heap[least])) {
+            least = left;
+        }
+        if (right < merge_heap_size && merge_before(merge_heap[right], merge_heap[least])) {
+            least = right;
+        }
+        if (least == i) {
+            return;
+        }
+        merge_heap_swap(i, least);
+        i = least;
+    }
+}
+
+static void merge_heap_remove(int slot) {
+    int i = users[slot].heap_index;
+    merge_heap_swap(i, --merge_heap_size);
+    users[slot].heap_index = -1;
+    if (i < merge_heap_size) {
+        merge_heap_up(i);
+        merge_heap_down(i);
+    }
+}
+
+static int merge_full(const struct User *user) {
+    return merge_enabled && user->pending_count == merge_lookahead;
+}
+
+/*
+ * True when every user still sending has a line pending or has been quiet
+ * for GROUP_MERGE_IDLE_MS. Otherwise sets merge_wait_ms to when the first
+ * quiet user will stop counting.
+ */
+static int merge_complete(void) {
+    long long now = merge_idle_ns >= 0 ? stats_now_ns() : 0;
+    long long wait_ns = -1;
+    for (int slot = 0; slot < slots_used; slot++) {
+        struct User *user = &users[slot];
+        if (!user->active || user->ended || user->pending_count > 0) {
+            continue;
+        }
+        if (merge_idle_ns < 0) {
+            return 0;
+        }
+        long long heard = user->heard_ns > merge_resumed_ns ? user->heard_ns : merge_resumed_ns;
+        long long left = heard + merge_idle_ns - now;
+        if (left > 0 && (wait_ns == -1 || left < wait_ns)) {
+            wait_ns = left;
+        }
+    }
+    if (wait_ns != -1) {
+        merge_wait_ms = (int)((wait_ns + 999999) / 1000000);
+        return 0;
+    }
+    return 1;
+}
+
+static void merge_push(int slot, int timestamp, const char *text, size_t len, long long parsed_ns) {
+    struct User *user = &users[slot];
+    if (user->pending == NULL) {
+        user->pending = malloc(merge_lookahead * sizeof(struct PendingLine));
+        if (user->pending == NULL) {
+            fprintf(stderr, "Out of memory for user lookahead\n");
+            exit(1);
+        }
+    }
+    struct PendingLine *line = &user->pending[(user->pending_head + user->pending_count) % merge_lookahead];
+    line->timestamp = timestamp;
+    line->len = len < MAX_MESSAGE_LENGTH ? len : MAX_MESSAGE_LENGTH - 1;
+    line->parsed_ns = parsed_ns;
+    memcpy(line->text, text, line->len);
+    if (merge_idle_ns >= 0) {
+        user->heard_ns = parsed_ns ? parsed_ns : stats_now_ns();
+    }
+    if (user->pending_count++ == 0) {
+        user->heap_index = merge_heap_size;
+        merge_heap[merge_heap_size++] = slot;
+        merge_heap_up(user->heap_index);
+    }
+    if (timestamp > merge_newest) {
+        merge_newest = timestamp;
+    }
+}
+
+/* Forgets a removed user's pending lines and unread bytes. */
+static void merge_drop(int slot) {
+    struct User *user = &users[slot];
+    if (user->pending_count > 0) {
+        merge_heap_remove(slot);
+    }
+    user->pending_head = 0;
+    user->pending_count = 0;
+    user->ended = 0;
+    user->stalled = 0;
+    user->overflow_len = 0;
+    user->overflow_pos = 0;
+}
+
+/*
+ * Reads the user's file through a private mapping instead of forking a
+ * writer. The bytes are exactly what the writer would have put in the pipe,
+ * and the user is fed through the same framing path, a chunk at a time.
+ * A file that cannot be opened behaves like a writer that exited at once.
+ */
+static void map_user_file(struct User *user, const char *user_file) {
+    user->mapped = 1;
+    user->map = NULL;
+    user->map_len = 0;
+    user->map_pos = 0;
+    user->pipe_fd[0] = user->pipe_fd[1] = -1;
+    user->pid = 0;
+    mapped_users++;
+
+    int fd = open(user_file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Error opening user file %s: %s\n", user_file, strerror(errno));
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "Error mapping user file %s: %s\n", user_file, strerror(errno));
+        } else {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            user->map = map;
+            user->map_len = st.st_size;
+        }
+    }
+    close(fd);
+}
+
+void add_user(const char* user_file) {
+    int slot = alloc_user_slot();
+    if (slot == -1) {
+   
+        fprintf(stderr, "Error: Cannot add user to group %d as group is already full,Current users:%d.\n", group_id,user_count);
+        return;
+    }
+    struct User *user = &users[slot];
+
+    if (ingest_mapped) {
+        map_user_file(user, user_file);
+        user->id = user->generation * MAX_USERS + slot;
+        user->active = 1;
+        user->partial_len = 0;
+        user->heard_ns = stats_now_ns();
+        user_count++;
+        send_validation_message(2, user->id);
+        log_event(LOG_INFO, "Added user %d from file %s\n", user_file, user->id);
+        return;
+    }
+    user->mapped = 0;
+
+    if (pipe(user->pipe_fd) == -1) {
+        fprintf(stderr, "Error creating pipe: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    user->pid = fork();
+    if (user->pid == -1) {
+        fprintf(stderr, "Error forking: %s\n", strerror(errno));
+        exit(1);
+    } else if (user->pid == 0) {
+        // Child process (user)
+        /*
+         * _exit: the child must not flush stdio buffers it inherited, and in
+         * the in-process runtime another thread may have held their locks
+         * at fork time.
+         */
+        close(user->pipe_fd[0]);
+        FILE* file = fopen(user_file, "r");
+        if (!file) {
+            fprintf(stderr, "Error opening user file %s: %s\n", user_file, strerror(errno));
+            _exit(1);
+        }
+
+        char line[MAX_MESSAGE_LENGTH];
+        while (fgets(line, sizeof(line), file)) {
+            ssize_t len = strlen(line);
+            if (write(user->pipe_fd[1], line, len) != len) {
+                fprintf(stderr, "Write error to pipe\n");
+                _exit(1);
+            }
+        }
+
+        fclose(file);
+        close(user->pipe_fd[1]);
+        _exit(0);
+    } else {
+        // Parent process (group)
+        close(user->pipe_fd[1]);
+        fcntl(user->pipe_fd[0], F_SETFL, O_NONBLOCK);
+        watch_fd(user->pipe_fd[0], FD_USER_PIPE, slot, user->pid);
+
+        if (sigchld_fd == -1) {
+            int pidfd = syscall(SYS_pidfd_open, user->pid, 0);
+            if (pidfd == -1) {
+                fprintf(stderr, "Error opening pidfd for user: %s\n", strerror(errno));
+                exit(1);
+            }
+            watch_fd(pidfd, FD_CHILD, -1, user->pid);
+        }
+        live_children++;
+
+        user->id = user->generation * MAX_USERS + slot;
+        user->active = 1;
+        user->partial_len = 0;
+        user->heard_ns = stats_now_ns();
+        user_count++;
+        send_validation_message(2, user->id);
+        log_event(LOG_INFO, "Added user %d from file %s\n", user_file, user->id);
+    }
+}
+
+/* O(1): frees the slot and signals the child; the exit is reaped by the event loop. */
+void remove_user(int user_index) {
+    if (user_index < 0 || user_index >= MAX_USERS || !users[user_index].active) {
+        fprintf(stderr, "Invalid user index to remove.\n");
+        return;
+    }
+    struct User *user = &users[user_index];
+    if (user->mapped) {
+        if (user->map != NULL) {
+            munmap((void *)user->map, user->map_len);
+        }
+        user->mapped = 0;
+        mapped_users--;
+    } else {
+        unwatch_fd(user->pipe_fd[0]);
+        kill(user->pid, SIGTERM);
+    }
+
+    merge_drop(user_index);
+    user->active = 0;
+    user->generation++;
+    free_slots[free_slot_count++] = user_index;
+    user_count--;
+    log_event(LOG_INFO, "Removed user %d, remaining users: %d\n", NULL, user->id, user_count);
+}
+
+/* A user that has sent everything leaves the group. */
+void finish_user(int user_index) {
+    log_event(LOG_INFO, "User %d has sent all messages\n", NULL, users[user_index].id);
+    remove_user(user_index);
+    removed_users++;
+}
+
+/*
+ * End of a user's input. With the ordering stage on, the user stays until
+ * its pending lines have been sent.
+ */
+void end_user_input(int user_index) {
+    if (users[user_index].pending_count > 0) {
+        users[user_index].ended = 1;
+        return;
+    }
+    finish_user(user_index);
+}
+
+/* Pipes are edge-triggered, so a stalled pipe goes back on the ready list by hand. */
+void resume_user_input(int fd) {
+    struct FdEntry *entry = fd_entry(fd);
+    if (entry->kind == FD_USER_PIPE && !entry->ready) {
+        entry->ready = 1;
+        ready_fds[ready_count++] = fd;
+    }
+}
+
+static void signal_inbox(struct VerdictInbox *box) {
+    uint64_t one = 1;
+    if (write(box->event_fd, &one, sizeof(one)) != sizeof(one)) {
+        fprintf(stderr, "Error signalling verdict: %s\n", strerror(errno));
+    }
+}
+
+/*
+ * Blocks on one moderator's verdict queue for verdicts addressed to this
+ * group and hands them to the event loop through the inbox's eventfd.
+ * There is one per moderator instance; the group cancels them once every
+ * moderator has echoed its close (see close_moderator_links()).
+ */
+void *verdict_listener(void *arg) {
+    struct ModeratorLink *link = arg;
+    struct VerdictInbox *box = link->inbox;
+    Message verdict;
+    while (1) {
+        if (msgrcv(link->verdict_queue_id, &verdict, sizeof(Message) - sizeof(long), box->mtype, 0) == -1) {
+            if (errno == EINTR) continue;
+            return NULL;
+        }
+        if (verdict.user == BATCH_ACK_USER) {
+            __atomic_store_n(&link->batching_enabled, 1, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (verdict.user == VERDICT_CLOSE_USER) {
+            __atomic_store_n(&link->closed, 1, __ATOMIC_RELEASE);
+            signal_inbox(box);
+            continue;
+        }
+        pthread_mutex_lock(&box->lock);
+        if (box->count == box->capacity) {
+            box->capacity = box->capacity ? box->capacity * 2 : 16;
+            box->pending = realloc(box->pending, box->capacity * sizeof(struct PendingVerdict));
+            if (box->pending == NULL) {
+                fprintf(stderr, "Out of memory queueing verdicts\n");
+                exit(1);
+            }
+        }
+        box->pending[box->count].user = verdict.user;
+        box->pending[box->count].sent_us = (unsigned int)verdict.timestamp;
+        box->count++;
+        pthread_mutex_unlock(&box->lock);
+        signal_inbox(box);
+    }
+}
+
+void start_verdict_listener(void) {
+    inbox.mtype = VERDICT_MTYPE_BASE + group_id;
+    inbox.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (inbox.event_fd == -1) {
+        fprintf(stderr, "Error creating verdict eventfd: %s\n", strerror(errno));
+        exit(1);
+    }
+    watch_fd(inbox.event_fd, FD_VERDICT, -1, 0);
+
+    pthread_mutex_init(&inbox.lock, NULL);
+    for (int i = 0; i < moderator_count; i++) {
+        moderators[i].inbox = &inbox;
+        if (pthread_create(&moderators[i].listener, NULL, verdict_listener, &moderators[i]) != 0) {
+            fprintf(stderr, "Error starting verdict listener\n");
+            exit(1);
+        }
+    }
+    inbox.running = 1;
+}
+
+void stop_verdict_listener(void) {
+    if (!inbox.running) {
+        return;
+    }
+    /* msgrcv is a cancellation point; the lock is never held across it. */
+    for (int i = 0; i < moderator_count; i++) {
+        pthread_cancel(moderators[i].listener);
+        pthread_join(moderators[i].listener, NULL);
+    }
+    inbox.running = 0;
+    pthread_mutex_destroy(&inbox.lock);
+    free(inbox.pending);
+    unwatch_fd(inbox.event_fd);
+}
+
+void handle_verdicts(void) {
+    uint64_t count;
+    while (read(inbox.event_fd, &count, sizeof(count)) == sizeof(count)) {
+    }
+
+    pthread_mutex_lock(&inbox.lock);
+    int n = inbox.count;
+    struct PendingVerdict verdicts[n > 0 ? n : 1];
+    memcpy(verdicts, inbox.pending, n * sizeof(struct PendingVerdict));
+    inbox.count = 0;
+    pthread_mutex_unlock(&inbox.lock);
+
+    for (int v = 0; v < n; v++) {
+        int slot = find_user(verdicts[v].user);
+        if (stats) {
+            stat_add(&stats->verdicts, 1);
+        }
+        if (slot != -1) {
+            log_event(LOG_INFO, "Received removal request from moderator for user %d\n", NULL, verdicts[v].user);
+            remove_user(slot);
+            removed_users++;
+            if (stats) {
+                /* Both ends use CLOCK_MONOTONIC; 32-bit microseconds wrap harmlessly. */
+                unsigned int now_us = (unsigned int)(stats_now_ns() / 1000);
+                stats_record(&stats->verdict_to_remove, (long long)(now_us - verdicts[v].sent_us) * 1000);
+                stat_add(&stats->users_removed, 1);
+            }
+        }
+    }
+}
+
+void handle_child_exit(int pidfd) {
+    waitpid(fd_entry(pidfd)->pid, NULL, WNOHANG);
+    unwatch_fd(pidfd);
+    live_children--;
+}
+
+void handle_sigchld(void) {
+    struct signalfd_siginfo info;
+    while (read(sigchld_fd, &info, sizeof(info)) == sizeof(info)) {
+    }
+    while (waitpid(-1, NULL, WNOHANG) > 0) {
+        live_children--;
+    }
+}
+
+static long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Sizes the record area so that a whole frame (group and count included)
+ * stays within the default MSGMAX and well under the queue's byte limit,
+ * so a batch never blocks alone.
+ */
+void init_batching(void) {
+    size_t frame_header = offsetof(struct BatchFrame, data) - sizeof(long);
+    size_t frame_max = BATCH_FRAME_BYTES;
+    struct msqid_ds info;
+    if (msgctl(moderators[0].queue_id, IPC_STAT, &info) == 0 && info.msg_qbytes / 2 < frame_max) {
+        frame_max = info.msg_qbytes / 2;
+    }
+    batch_limit = frame_max - frame_header;
+}
+
+/*
+ * Sends to a queue without ever blocking the group loop. A message the
+ * queue has no room for is appended to the outbox, as is anything sent
+ * while the outbox is not empty, so the reader still gets messages in
+ * order. The event loop retries the outboxes and reads no user input until
+ * they have drained; the verdict listeners keep running meanwhile.
+ */
+static void queue_send(int queue_id, struct Outbox *box, const void *msg, size_t size, const char *target) {
+    if (box->head == box->used) {
+        int sent;
+        while ((sent = msgsnd(queue_id, msg, size, IPC_NOWAIT)) == -1 && errno == EINTR) {
+        }
+        if (sent == 0) {
+            return;
+        }
+        if (errno != EAGAIN) {
+            fprintf(stderr, "Error sending message to %s: %s\n", target, strerror(errno));
+            exit(1);
+        }
+    }
+
+    size_t entry = (sizeof(size_t) + sizeof(long) + size + 7) & ~(size_t)7;
+    if (box->used + entry > box->capacity) {
+        memmove(box->data, box->data + box->head, box->used - box->head);
+        box->used -= box->head;
+        box->head = 0;
+    }
+    if (box->used + entry > box->capacity) {
+        size_t capacity = box->capacity ? box->capacity : 65536;
+        while (box->used + entry > capacity) capacity *= 2;
+        box->data = realloc(box->data, capacity);
+        if (box->data == NULL) {
+            fprintf(stderr, "Out of memory queueing %s messages\n", target);
+            exit(1);
+        }
+        box->capacity = capacity;
+    }
+    memcpy(box->data + box->used, &size, sizeof(size));
+    memcpy(box->data + box->used + sizeof(size_t), msg, sizeof(long) + size);
+    box->used += entry;
+    throttled = 1;
+    if (stats) {
+        stat_add(&stats->throttled_sends, 1);
+    }
+}
+
+/* Retries an outbox in order, blocking on a full queue if wait is set; returns whether it is still backed up. */
+static int outbox_drain(int queue_id, struct Outbox *box, int wait, const char *target) {
+    while (box->head < box->used) {
+        size_t size;
+        memcpy(&size, box->data + box->head, sizeof(size));
+        if (msgsnd(queue_id, box->data + box->head + sizeof(size_t), size, wait ? 0 : IPC_NOWAIT) == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) {
+                fprintf(stderr, "Error sending message to %s: %s\n", target, strerror(errno));
+                exit(1);
+            }
+            return 1;
+        }
+        box->head += (sizeof(size_t) + sizeof(long) + size + 7) & ~(size_t)7;
+    }
+    box->head = box->used = 0;
+    return 0;
+}
+
+void send_to_moderator(struct ModeratorLink *link, const void *msg, size_t size) {
+    queue_send(link->queue_id, &link->outbox, msg, size, "moderator");
+}
+
+void send_to_validation(const Message *msg) {
+    queue_send(validation_queue_id, &validation_outbox, msg, sizeof(Message) - sizeof(long), "validation");
+}
+
+/* Retries every outbox in order; returns how many queues are still backed up. */
+int drain_outboxes(void) {
+    int backed_up = outbox_drain(validation_queue_id, &validation_outbox, 0, "validation");
+    for (int i = 0; i < moderator_count; i++) {
+        backed_up += outbox_drain(moderators[i].queue_id, &moderators[i].outbox, 0, "moderator");
+    }
+    return backed_up;
+}
+
+void flush_batch(struct ModeratorLink *link) {
+    struct BatchFrame *batch = &link->batch;
+    if (batch->count == 0) {
+        return;
+    }
+    batch->mtype = BATCH_MTYPE_BASE + group_id;
+    batch->group = group_id;
+    size_t size = offsetof(struct BatchFrame, data) - sizeof(long) + link->batch_used;
+    send_to_moderator(link, batch, size);
+    log_event(LOG_DEBUG, "Sent batch of %d messages (%zu bytes) to moderator\n", NULL, batch->count, link->batch_used);
+    batch->count = 0;
+    link->batch_used = 0;
+}
+
+/* Flushes every batch whose deadline has passed, or all of them; returns ms until the next deadline, -1 if none. */
+int flush_batches(int all) {
+    long long now = monotonic_ms(), next = -1;
+    for (int i = 0; i < moderator_count; i++) {
+        struct ModeratorLink *link = &moderators[i];
+        if (link->batch.count == 0) {
+            continue;
+        }
+        if (all || now >= link->batch_deadline_ms) {
+            flush_batch(link);
+        } else if (next == -1 || link->batch_deadline_ms - now < next) {
+            next = link->batch_deadline_ms - now;
+        }
+    }
+    return (int)next;
+}
+
+void batch_message(struct ModeratorLink *link, const Message *msg) {
+    struct BatchFrame *batch = &link->batch;
+    struct BatchRecordHeader header = {
+        .timestamp = msg->timestamp,
+        .user = msg->user,
+        .len = strlen(msg->mtext),
+    };
+    if (link->batch_used + sizeof(header) + header.len > batch_limit) {
+        flush_batch(link);
+    }
+    if (batch->count == 0) {
+        link->batch_deadline_ms = monotonic_ms() + BATCH_FLUSH_MS;
     }
-    printf("Sent validation message: type=%d, group=%d, user=%d\n", mtype, group_id, user);
+    memcpy(batch->data + link->batch_used, &header, sizeof(header));
+    memcpy(batch->data + link->batch_used + sizeof(header), msg->mtext, header.len);
+    link->batch_used += sizeof(header) + header.len;
+    batch->count++;
 }
 
-void add_user(const char* user_file) {
-    if (user_count >= MAX_USERS) {
-   
-        fprintf(stderr, "Error: Cannot add user to group %d as group is already full,Current users:%d.\n", group_id,user_count);
+/*
+ * Copies the text of a line into a message, stopping at the first NUL (as
+ * sscanf would, since the line was a C string to it) or after len bytes.
+ * dst must have room for len + 1 bytes; returns the number of bytes copied
+ * and terminates dst. glibc's memchr and memcpy are already vectorized.
+ */
+static size_t copy_text_span(char *dst, const char *src, size_t len) {
+    const char *nul = memchr(src, '\0', len);
+    size_t n = nul ? (size_t)(nul - src) : len;
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+    return n;
+}
+
+/*
+ * Line framing kernels: store the offsets of the first max newlines in
+ * data[0, len) into ends and return how many there were. A vector kernel
+ * compares a whole block against '\n' and walks the resulting bit mask, so
+ * a read full of short lines costs one pass instead of a memchr call per
+ * line.
+ */
+static size_t scan_newlines_scalar(const char *data, size_t len, uint32_t *ends, size_t max) {
+    size_t n = 0;
+    const char *p = data, *end = data + len, *nl;
+    while (n < max && p < end && (nl = memchr(p, '\n', end - p)) != NULL) {
+        ends[n++] = nl - data;
+        p = nl + 1;
+    }
+    return n;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static size_t scan_newlines_sse2(const char *data, size_t len, uint32_t *ends, size_t max) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t n = 0, i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+        for (; mask != 0; mask &= mask - 1) {
+            if (n == max) {
+                return n;
+            }
+            ends[n++] = i + __builtin_ctz(mask);
+        }
+    }
+    for (; i < len && n < max; i++) {
+        if (data[i] == '\n') {
+            ends[n++] = i;
+        }
+    }
+    return n;
+}
+
+__attribute__((target("avx2")))
+static size_t scan_newlines_avx2(const char *data, size_t len, uint32_t *ends, size_t max) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t n = 0, i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+        for (; mask != 0; mask &= mask - 1) {
+            if (n == max) {
+                return n;
+            }
+            ends[n++] = i + __builtin_ctz(mask);
+        }
+    }
+    for (; i < len && n < max; i++) {
+        if (data[i] == '\n') {
+            ends[n++] = i;
+        }
+    }
+    return n;
+}
+#endif
+
+static size_t (*scan_newlines)(const char *data, size_t len, uint32_t *ends, size_t max) = scan_newlines_scalar;
+static pthread_once_t line_parser_once = PTHREAD_ONCE_INIT;
+
+/* Picks the widest framing kernel the CPU supports; GROUP_PARSER=scalar forces the memchr one. */
+static void select_line_parser(void) {
+    const char *parser = getenv("GROUP_PARSER");
+    if (parser != NULL && strcmp(parser, "scalar") == 0) {
         return;
     }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_newlines = scan_newlines_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        scan_newlines = scan_newlines_sse2;
+    }
+#endif
+}
 
-    if (pipe(users[user_count].pipe_fd) == -1) {
-        fprintf(stderr, "Error creating pipe: %s\n", strerror(errno));
+static int is_scanf_space(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/*
+ * Parses the "<timestamp> <text>" prefix of a line the way
+ * sscanf("%d %255[^\n]") did: optional leading whitespace, a signed decimal,
+ * optional whitespace, then at least one byte of text. Out-of-range
+ * timestamps saturate instead of wrapping, so they fail the MAX_TIMESTAMP
+ * check rather than slipping through as negative values. On success sets
+ * *text to the start of the text and returns 0; returns -1 otherwise.
+ */
+static int parse_line_prefix(const char *line, const char *end, int *timestamp, const char **text) {
+    const char *p = line;
+    while (p < end && is_scanf_space(*p)) {
+        p++;
+    }
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    const char *digits = p;
+    long long value = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (value <= INT_MAX) {
+            value = value * 10 + (*p - '0');
+        }
+        p++;
+    }
+    if (p == digits) {
+        return -1;
+    }
+    if (negative) {
+        *timestamp = value > (long long)INT_MAX + 1 ? INT_MIN : (int)-value;
+    } else {
+        *timestamp = value > INT_MAX ? INT_MAX : (int)value;
+    }
+    while (p < end && is_scanf_space(*p)) {
+        p++;
+    }
+    if (p == end || *p == '\0') {
+        return -1;
+    }
+    *text = p;
+    return 0;
+}
+
+static void start_trace(const char *dir) {
+    snprintf(trace_path, sizeof(trace_path), "%s/group_%d.trace", dir, group_id);
+    trace_file = fopen(trace_path, "w");
+    if (trace_file == NULL) {
+        fprintf(stderr, "Error creating trace %s: %s\n", trace_path, strerror(errno));
         exit(1);
     }
+    setvbuf(trace_file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+    struct TraceHeader header = {.magic = TRACE_MAGIC, .version = TRACE_VERSION, .group = group_id};
+    fwrite(&header, sizeof(header), 1, trace_file);
+}
 
-    users[user_count].pid = fork();
-    if (users[user_count].pid == -1) {
-        fprintf(stderr, "Error forking: %s\n", strerror(errno));
+static void trace_message(const Message *msg, size_t len) {
+    struct TraceRecord record = {
+        .sent_ns = stats_now_ns(),
+        .timestamp = msg->timestamp,
+        .user = msg->user,
+        .len = len,
+    };
+    fwrite(&record, sizeof(record), 1, trace_file);
+    fwrite(msg->mtext, 1, len, trace_file);
+    trace_records++;
+}
+
+static void finish_trace(void) {
+    int failed = ferror(trace_file);
+    if (fclose(trace_file) != 0 || failed) {
+        fprintf(stderr, "Error writing trace %s\n", trace_path);
         exit(1);
-    } else if (users[user_count].pid == 0) {
-        // Child process (user)
-        close(users[user_count].pipe_fd[0]);
-        FILE* file = fopen(user_file, "r");
-        if (!file) {
-            fprintf(stderr, "Error opening user file %s: %s\n", user_file, strerror(errno));
-            exit(1);
+    }
+    trace_file = NULL;
+    printf("Recorded %ld messages to %s\n", trace_records, trace_path);
+}
+
+/* Sends one line to the validator and the moderator. */
+void send_line(int user_index, int timestamp, const char *text, size_t text_len, long long parsed_ns) {
+    Message val_msg;
+    val_msg.mtype = MAX_NUMBER_OF_GROUPS + group_id;
+    val_msg.timestamp = timestamp;
+    val_msg.user = users[user_index].id;
+    val_msg.modifyingGroup = group_id;
+    if (text_len > sizeof(val_msg.mtext) - 1) {
+        text_len = sizeof(val_msg.mtext) - 1;
+    }
+    text_len = copy_text_span(val_msg.mtext, text, text_len);
+    if (trace_file) {
+        trace_message(&val_msg, text_len);
+    }
+
+    send_to_validation(&val_msg);
+    if (stats) {
+        stats_record(&stats->parse_to_send, stats_now_ns() - parsed_ns);
+        stat_add(&stats->messages_sent, 1);
+    }
+    /* One debug record per line, covering both copies. */
+    log_event(LOG_DEBUG, "Sent message: user=%d, timestamp=%d, text=%s\n", val_msg.mtext, val_msg.user, val_msg.timestamp);
+
+    struct ModeratorLink *link = moderator_for(users[user_index].id);
+    if (link->bus) {
+        /*
+         * The ring slot is claimed only once validation has its copy: the
+         * moderator consumes slots in order, so a slot claimed and never
+         * published would stall every group on this instance.
+         */
+        struct BusSlot *slot = bus_claim(link->bus);
+        memcpy(&slot->msg, &val_msg, offsetof(Message, mtext) + text_len + 1);
+        slot->msg.modifyingGroup = group_id;
+        bus_publish(link->bus, slot);
+    } else if (__atomic_load_n(&link->batching_enabled, __ATOMIC_ACQUIRE)) {
+        batch_message(link, &val_msg);
+    } else {
+        send_to_moderator(link, &val_msg, sizeof(Message) - sizeof(long));
+    }
+}
+
+/*
+ * Sends lines in timestamp order. The oldest pending line goes out once
+ * every user still sending has a line pending, since no user can then
+ * produce anything older (each user's own file is in timestamp order), or
+ * once it is GROUP_MERGE_LATENESS older than the newest line seen. Users
+ * that filled their lookahead resume reading as soon as they have room.
+ */
+void merge_release(void) {
+    merge_wait_ms = -1;
+    int complete = merge_complete();
+    while (merge_heap_size > 0) {
+        int slot = merge_heap[0];
+        struct User *user = &users[slot];
+        struct PendingLine *line = &user->pending[user->pending_head];
+        if (!complete && !(merge_lateness >= 0 && line->timestamp <= merge_newest - merge_lateness)) {
+            break;
+        }
+        send_line(slot, line->timestamp, line->text, line->len, line->parsed_ns);
+        user->pending_head = (user->pending_head + 1) % merge_lookahead;
+        user->pending_count--;
+        if (user->stalled && !user->mapped) {
+            user->stalled = 0;
+            resume_user_input(user->pipe_fd[0]);
+        }
+        if (user->pending_count > 0) {
+            merge_heap_down(0);
+            continue;
+        }
+        merge_heap_remove(slot);
+        if (user->ended) {
+            finish_user(slot);
+        } else {
+            complete = 0;
+        }
+    }
+    if (merge_heap_size > 0 && merge_wait_ms == -1) {
+        /* Something is held: make sure the event loop wakes up to let idle users go. */
+        if (merge_complete()) {
+            merge_wait_ms = 0;
         }
+    }
+}
 
-        char line[MAX_MESSAGE_LENGTH];
-        while (fgets(line, sizeof(line), file)) {
-            ssize_t len = strlen(line);
-            if (write(users[user_count].pipe_fd[1], line, len) != len) {
-                fprintf(stderr, "Write error to pipe\n");
-                exit(1);
-            }
+/* Parses one complete line ("<timestamp> <text>") and hands it to the ordering stage or sends it. */
+void dispatch_line(int user_index, const char *line, size_t len) {
+    if (len > MAX_LINE_LENGTH) {
+        len = MAX_LINE_LENGTH;
+    }
+    const char *end = line + len;
+
+    int timestamp;
+    const char *text;
+    long long parsed_ns = 0;
+    int parsed = parse_line_prefix(line, end, &timestamp, &text);
+    if (stats) {
+        parsed_ns = stats_now_ns();
+        stat_add(&stats->lines, 1);
+        stats_record(&stats->read_to_parse, parsed_ns - chunk_read_ns);
+    }
+    if (parsed == -1) {
+        if (stats) {
+            stat_add(&stats->parse_errors, 1);
         }
+        fprintf(stderr, "Error parsing message from user %d\n", users[user_index].id);
+        return;
+    }
 
-        fclose(file);
-        close(users[user_count].pipe_fd[1]);
-        exit(0);
+    if (timestamp > MAX_TIMESTAMP) {
+        fprintf(stderr, "Error: Timestamp exceeds maximum allowed value\n");
+        return;
+    }
+
+    if (merge_enabled) {
+        merge_push(user_index, timestamp, text, end - text, parsed_ns);
     } else {
-        // Parent process (group)
-        close(users[user_count].pipe_fd[1]);
-        users[user_count].id = user_count;
-        send_validation_message(2, user_count);
-        user_count++;
-        printf("Added user %d from file %s\n", user_count - 1, user_file);
+        send_line(user_index, timestamp, text, end - text, parsed_ns);
     }
 }
 
-void remove_user(int user_index) {
-    if (user_index < 0 || user_index >= user_count) {
-        fprintf(stderr, "Invalid user index to remove.\n");
-        return;
+static void append_partial(struct User *user, const char *data, size_t len) {
+    size_t room = MAX_LINE_LENGTH - user->partial_len;
+    if (len > room) {
+        len = room;
     }
-    close(users[user_index].pipe_fd[0]);
-    kill(users[user_index].pid, SIGTERM);
-    waitpid(users[user_index].pid, NULL, 0);
+    memcpy(user->partial + user->partial_len, data, len);
+    user->partial_len += len;
+}
+
+/*
+ * Frames and dispatches complete lines and keeps an unterminated tail as
+ * the user's partial line. Returns how many bytes were consumed: less than
+ * len only when the user's lookahead filled up, in which case the rest has
+ * to be offered again once lines have been released.
+ */
+size_t frame_lines(int user_index, const char *data, size_t len) {
+    struct User *user = &users[user_index];
+    const char *p = data, *end = data + len;
+    uint32_t ends[FRAME_LINES_BATCH];
 
-    for (int i = user_index; i < user_count - 1; i++) {
-        users[i] = users[i + 1];
-        users[i].id = i;
+    while (p < end) {
+        size_t found = scan_newlines(p, end - p, ends, FRAME_LINES_BATCH);
+        if (found == 0) {
+            break;
+        }
+        const char *line = p;
+        for (size_t i = 0; i < found; i++) {
+            const char *nl = p + ends[i];
+            if (merge_full(user)) {
+                return line - data;
+            }
+            if (user->partial_len > 0) {
+                append_partial(user, line, nl - line);
+                dispatch_line(user_index, user->partial, user->partial_len);
+                user->partial_len = 0;
+            } else {
+                dispatch_line(user_index, line, nl - line);
+            }
+            line = nl + 1;
+        }
+        p = line;
     }
-    user_count--;
-    printf("Removed user %d, remaining users: %d\n", user_index, user_count);
+    append_partial(user, p, end - p);
+    return len;
 }
 
-void process_user_messages() {
-    fd_set read_fds;
-    int max_fd = -1;
-    Message val_msg, mod_response;
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = 10000;
-
-    while (user_count > 0) {
-        FD_ZERO(&read_fds);
-        max_fd = -1;
-        for (int i = 0; i < user_count; i++) {
-            FD_SET(users[i].pipe_fd[0], &read_fds);
-            if (users[i].pipe_fd[0] > max_fd) {
-                max_fd = users[i].pipe_fd[0];
+/*
+ * Reads a user's pipe in large chunks until it would block. Pipes are
+ * edge-triggered, so a pipe that still has data after READS_PER_WAKEUP reads
+ * is put on the ready list and revisited after the other pending events
+ * rather than starving them; so is one whose moderator sends are being
+ * throttled. A user whose lookahead is full is not read; merge_release()
+ * puts it back on the ready list.
+ */
+void handle_user_input(int user_index) {
+    static __thread char chunk[READ_CHUNK_SIZE];
+    struct User *user = &users[user_index];
+    if (user->overflow_pos < user->overflow_len) {
+        chunk_read_ns = user->overflow_read_ns;
+        user->overflow_pos += frame_lines(user_index, user->overflow + user->overflow_pos,
+                                          user->overflow_len - user->overflow_pos);
+        if (user->overflow_pos < user->overflow_len) {
+            user->stalled = 1;
+            return;
+        }
+    }
+    for (int reads = 0; ; reads++) {
+        if (reads == READS_PER_WAKEUP || throttled) {
+            resume_user_input(user->pipe_fd[0]);
+            return;
+        }
+        if (merge_full(user)) {
+            user->stalled = 1;
+            return;
+        }
+        ssize_t bytes_read = read(user->pipe_fd[0], chunk, sizeof(chunk));
+        if (bytes_read > 0) {
+            if (stats) {
+                chunk_read_ns = stats_now_ns();
+                stat_add(&stats->bytes_read, bytes_read);
+            }
+            size_t framed = frame_lines(user_index, chunk, bytes_read);
+            if (framed < (size_t)bytes_read) {
+                if (user->overflow == NULL && (user->overflow = malloc(READ_CHUNK_SIZE)) == NULL) {
+                    fprintf(stderr, "Out of memory for user input\n");
+                    exit(1);
+                }
+                memcpy(user->overflow, chunk + framed, bytes_read - framed);
+                user->overflow_len = bytes_read - framed;
+                user->overflow_pos = 0;
+                user->overflow_read_ns = chunk_read_ns;
+                user->stalled = 1;
+                return;
+            }
+        } else if (bytes_read == 0) {
+            /* A last line without a trailing newline still counts, as with fgets. */
+            if (user->partial_len > 0) {
+                dispatch_line(user_index, user->partial, user->partial_len);
+                user->partial_len = 0;
+            }
+            end_user_input(user_index);
+            return;
+        } else {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) {
+                perror("Read error");
+            }
+            return;
+        }
+    }
+}
+
+/*
+ * Feeds every mapped user one chunk, round-robin, so they interleave like
+ * pipes. A user with a full lookahead is skipped until it has room.
+ */
+void feed_mapped_users(void) {
+    for (int slot = 0; slot < slots_used; slot++) {
+        struct User *user = &users[slot];
+        if (!user->active || !user->mapped || user->ended || merge_full(user)) {
+            continue;
+        }
+        size_t left = user->map_len - user->map_pos;
+        if (left > 0) {
+            size_t len = left < READ_CHUNK_SIZE ? left : READ_CHUNK_SIZE;
+            if (stats) {
+                chunk_read_ns = stats_now_ns();
             }
+            size_t framed = frame_lines(slot, user->map + user->map_pos, len);
+            user->map_pos += framed;
+            if (stats) {
+                stat_add(&stats->bytes_read, framed);
+            }
+            continue;
         }
+        if (user->partial_len > 0) {
+            dispatch_line(slot, user->partial, user->partial_len);
+            user->partial_len = 0;
+        }
+        end_user_input(slot);
+    }
+}
+
+void process_user_messages() {
+    struct epoll_event events[MAX_EVENTS];
 
-        if (max_fd == -1) break;
+    start_verdict_listener();
+    init_batching();
 
-        int select_result = select(max_fd + 1, &read_fds, NULL, NULL, &tv);
-        if (select_result == -1) {
+    int batch_wait = -1;
+    while (user_count > 0 || live_children > 0) {
+        if (throttled) {
+            throttled = drain_outboxes() > 0;
+            if (!throttled) {
+                merge_resumed_ns = stats_now_ns();
+            }
+        }
+        int timeout = batch_wait;
+        if (throttled) {
+            timeout = OUTBOX_RETRY_MS;
+        } else if (ready_count > 0 || mapped_users > 0) {
+            timeout = 0;
+        } else if (merge_wait_ms >= 0 && (timeout < 0 || merge_wait_ms < timeout)) {
+            timeout = merge_wait_ms;
+        }
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if (ready == -1) {
             if (errno == EINTR) continue;
-            fprintf(stderr, "Error in select: %s\n", strerror(errno));
+            fprintf(stderr, "Error in epoll_wait: %s\n", strerror(errno));
             exit(1);
-        } else if (select_result == 0) {
-            continue;
         }
 
-        for (int i = 0; i < user_count; i++) {
-            if (FD_ISSET(users[i].pipe_fd[0], &read_fds)) {
-                char buffer[MAX_MESSAGE_LENGTH];
-                ssize_t bytes_read = read(users[i].pipe_fd[0], buffer, sizeof(buffer) - 1);
-                if (bytes_read > 0) {
-                    buffer[bytes_read] = '\0';
-                    int timestamp;
-                    char text[MAX_MESSAGE_LENGTH];
-                    if (sscanf(buffer, "%d %[^\n]", &timestamp, text) != 2) {
-                        fprintf(stderr, "Error parsing message from user %d\n", users[i].id);
-                        continue;
-                    }
-
-                    if (timestamp > MAX_TIMESTAMP) {
-                        fprintf(stderr, "Error: Timestamp exceeds maximum allowed value\n");
-                        continue;
-                    }
-
-                    val_msg.mtype = MAX_NUMBER_OF_GROUPS + group_id;
-                    val_msg.timestamp = timestamp;
-                    val_msg.user = users[i].id;
-                    val_msg.modifyingGroup = group_id;
-                    strncpy(val_msg.mtext, text, sizeof(val_msg.mtext) - 1);
-                    val_msg.mtext[sizeof(val_msg.mtext) - 1] = '\0';
-                   
-                    if (msgsnd(validation_queue_id, &val_msg, sizeof(Message) - sizeof(long), 0) == -1) {
-                   
-                        fprintf(stderr, "Error sending message to validation: %s\n", strerror(errno));
-                        exit(1);
-                    }
-                    printf("Sent message to validation: user=%d, timestamp=%d, text=%s\n", val_msg.user, val_msg.timestamp, val_msg.mtext);
-
-                    if (msgsnd(moderator_groups_queue_id, &val_msg, sizeof(Message) - sizeof(long), 0) == -1) {
-                        fprintf(stderr, "Error sending message to moderator: %s\n", strerror(errno));
-                        exit(1);
-                    }
-                    printf("Sent message to moderator: user=%d, timestamp=%d, text=%s\n", val_msg.user, val_msg.timestamp, val_msg.mtext);
-
-                    if (msgrcv(moderator_groups_queue_id, &mod_response, sizeof(Message) - sizeof(long), group_id, IPC_NOWAIT) != -1) {
-                        if (mod_response.user == users[i].id) {
-                            printf("Received removal request from moderator for user %d\n", mod_response.user);
-                            remove_user(i);
-                            removed_users++;
-                            i--;
-                        }
-                    }
-                } else if (bytes_read == 0) {
-                    printf("User %d has sent all messages\n", users[i].id);
-                    remove_user(i);
-                    removed_users++;
-                    i--;
+        for (int e = 0; e < ready; e++) {
+            int fd = events[e].data.fd;
+            struct FdEntry *entry = fd_entry(fd);
+            switch (entry->kind) {
+            case FD_USER_PIPE:
+                if (throttled) {
+                    resume_user_input(fd);
                 } else {
-                    perror("Read error");
+                    handle_user_input(entry->user_index);
+                }
+                break;
+            case FD_CHILD:
+                handle_child_exit(fd);
+                break;
+            case FD_VERDICT:
+                handle_verdicts();
+                break;
+            case FD_SIGCHLD:
+                handle_sigchld();
+                break;
+            case FD_UNUSED:
+                /* Deregistered earlier in this batch. */
+                break;
+            }
+        }
+
+        /* Input resumes once the moderator queues have room again. */
+        if (throttled) {
+            batch_wait = flush_batches(0);
+            continue;
+        }
+
+        int backlog = ready_count;
+        int backlog_fds[MAX_USERS];
+        memcpy(backlog_fds, ready_fds, backlog * sizeof(int));
+        for (int r = 0; r < backlog; r++) {
+            struct FdEntry *entry = fd_entry(backlog_fds[r]);
+            if (entry->kind != FD_USER_PIPE || !entry->ready) {
+                continue;
+            }
+            entry->ready = 0;
+            for (int i = 0; i < ready_count; i++) {
+                if (ready_fds[i] == backlog_fds[r]) {
+                    ready_fds[i] = ready_fds[--ready_count];
+                    break;
                 }
             }
+            handle_user_input(entry->user_index);
+        }
+
+        if (mapped_users > 0) {
+            feed_mapped_users();
+        }
+
+        if (merge_enabled) {
+            merge_release();
         }
+
+        batch_wait = flush_batches(0);
     }
+    flush_batches(1);
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <group_id> <test_case_number>\n", argv[0]);
-        exit(1);
+static int links_closed(void) {
+    int closed = 0;
+    for (int i = 0; i < moderator_count; i++) {
+        closed += __atomic_load_n(&moderators[i].closed, __ATOMIC_ACQUIRE);
     }
+    return closed;
+}
 
-    group_id = atoi(argv[1]);
-    int test_case = atoi(argv[2]);
-    printf("Starting group %d for test case %d\n", group_id, test_case);
+/*
+ * Tells every moderator this group is done and waits until each has echoed
+ * it on its verdict queue. The echo follows every verdict the moderator
+ * sent for the group, so once all are in nothing is left for the listeners
+ * and no moderator can block sending to a group that stopped reading.
+ */
+void close_moderator_links(void) {
+    if (!inbox.running) {
+        return;
+    }
+    Message close_msg = {.mtype = MAX_NUMBER_OF_GROUPS + group_id, .user = VERDICT_CLOSE_USER, .modifyingGroup = group_id};
+    for (int i = 0; i < moderator_count; i++) {
+        struct ModeratorLink *link = &moderators[i];
+        if (link->bus) {
+            struct BusSlot *slot = bus_claim(link->bus);
+            slot->msg = close_msg;
+            bus_publish(link->bus, slot);
+        } else {
+            send_to_moderator(link, &close_msg, sizeof(Message) - sizeof(long));
+        }
+    }
 
-    char testcase_folder[256];
-    snprintf(testcase_folder, sizeof(testcase_folder), "testcase_%d", test_case);
+    struct epoll_event events[MAX_EVENTS];
+    long long deadline = monotonic_ms() + VERDICT_CLOSE_TIMEOUT_MS;
+    while (links_closed() < moderator_count) {
+        int backed_up = drain_outboxes();
+        long long left = deadline - monotonic_ms();
+        if (left <= 0) {
+            fprintf(stderr, "Group %d: %d moderator(s) did not confirm its last verdicts\n",
+                    group_id, moderator_count - links_closed());
+            break;
+        }
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, backed_up ? OUTBOX_RETRY_MS : (int)left);
+        if (ready == -1 && errno != EINTR) {
+            fprintf(stderr, "Error in epoll_wait: %s\n", strerror(errno));
+            exit(1);
+        }
+        for (int e = 0; e < ready; e++) {
+            if (fd_entry(events[e].data.fd)->kind == FD_VERDICT) {
+                handle_verdicts();
+            }
+        }
+    }
+
+    /* Nothing for this group follows the close echo but a batching offer; leave none for its next run. */
+    Message stale;
+    for (int i = 0; i < moderator_count; i++) {
+        struct ModeratorLink *link = &moderators[i];
+        if (!__atomic_load_n(&link->closed, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        while (msgrcv(link->verdict_queue_id, &stale, sizeof(Message) - sizeof(long), inbox.mtype, IPC_NOWAIT) != -1) {
+        }
+    }
+}
 
+static void load_config(const char *testcase_folder, struct ChatConfig *config) {
     char input_file_path[512];
     snprintf(input_file_path, sizeof(input_file_path), "%s/input.txt", testcase_folder);
-   
-    int n, threshold;
-    char group_paths[MAX_GROUPS][256];
 
     FILE* input_file = fopen(input_file_path, "r");
     if (!input_file) {
@@ -224,37 +1833,85 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    if (fscanf(input_file, "%d %d %d %d %d", &n, &validation_queue_key,
-               &app_groups_queue_key, &moderator_groups_queue_key, &threshold) != 5) {
+    if (fscanf(input_file, "%d %d %d %d %d", &config->n, &config->validation_queue_key,
+               &config->app_groups_queue_key, &config->moderator_groups_queue_key, &config->threshold) != 5) {
         fprintf(stderr, "Error reading from input file: Invalid format\n");
         exit(1);
     }
     printf("Read from input file: n=%d, validation_key=%d, app_key=%d, moderator_key=%d, threshold=%d\n",
-           n, validation_queue_key, app_groups_queue_key, moderator_groups_queue_key, threshold);
+           config->n, config->validation_queue_key, config->app_groups_queue_key,
+           config->moderator_groups_queue_key, config->threshold);
 
-    for (int i = 0; i < n; i++) {
-        if (fscanf(input_file, "%s", group_paths[i]) != 1) {
+    if (config->n < 0 || config->n > MAX_GROUPS) {
+        fprintf(stderr, "Invalid number of groups in input file: %d\n", config->n);
+        exit(1);
+    }
+    for (int i = 0; i < config->n; i++) {
+        if (fscanf(input_file, "%255s", config->group_paths[i]) != 1) {
             fprintf(stderr, "Error reading group file paths from input file\n");
             exit(1);
         }
-        printf("Group %d path: %s\n", i, group_paths[i]);
+        printf("Group %d path: %s\n", i, config->group_paths[i]);
     }
     fclose(input_file);
+}
 
-    validation_queue_id = msgget(validation_queue_key, 0666);
-    app_groups_queue_id = msgget(app_groups_queue_key, 0666);
-    moderator_groups_queue_id = msgget(moderator_groups_queue_key, 0666);
+/*
+ * Maps the snapshot app.c published for this test case. Returns NULL when
+ * there is none, or when it is incomplete or was built from a different
+ * input.txt (a leftover from an earlier run).
+ */
+static const struct ConfigSnapshot *attach_config_snapshot(const char *testcase_folder, int test_case) {
+    char name[64];
+    snprintf(name, sizeof(name), "/chat-config-%d", test_case);
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct ConfigSnapshot)) {
+        close(fd);
+        return NULL;
+    }
+    const struct ConfigSnapshot *snapshot = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (snapshot == MAP_FAILED) {
+        return NULL;
+    }
 
-    if (validation_queue_id == -1 || app_groups_queue_id == -1 || moderator_groups_queue_id == -1) {
-        fprintf(stderr, "Error connecting to message queues: %s\n", strerror(errno));
-        exit(1);
+    char input_file_path[512];
+    snprintf(input_file_path, sizeof(input_file_path), "%s/input.txt", testcase_folder);
+    struct stat input_st;
+    if (__atomic_load_n(&snapshot->magic, __ATOMIC_ACQUIRE) != CONFIG_SNAPSHOT_MAGIC ||
+        snapshot->version != CONFIG_SNAPSHOT_VERSION || snapshot->size != (unsigned int)st.st_size ||
+        snapshot->test_case != test_case || stat(input_file_path, &input_st) == -1 ||
+        snapshot->input_dev != (unsigned long long)input_st.st_dev ||
+        snapshot->input_ino != (unsigned long long)input_st.st_ino ||
+        snapshot->input_size != (long long)input_st.st_size ||
+        snapshot->input_mtime_ns != (long long)input_st.st_mtim.tv_sec * 1000000000LL + input_st.st_mtim.tv_nsec) {
+        munmap((void *)snapshot, st.st_size);
+        return NULL;
     }
-    printf("Connected to all message queues successfully\n");
+    return snapshot;
+}
 
-    send_validation_message(1, 0);
+static const char *snapshot_string(const struct ConfigSnapshot *snapshot, unsigned int offset) {
+    return (const char *)snapshot + offset;
+}
+
+/* User paths in the snapshot were already checked and joined by app.c. */
+static void add_users_from_snapshot(const struct ConfigSnapshot *snapshot) {
+    const struct ConfigSnapshotGroup *group = &snapshot->groups[group_id];
+    const unsigned int *user_paths = (const unsigned int *)((const char *)snapshot + group->users);
+    log_event(LOG_INFO, "Number of users in group %d: %d\n", NULL, group_id, group->user_count);
+    for (int i = 0; i < group->user_count; i++) {
+        add_user(snapshot_string(snapshot, user_paths[i]));
+    }
+}
 
+static void add_users_from_group_file(const char *testcase_folder, const char *group_path) {
     char group_file_path[512];
-    snprintf(group_file_path, sizeof(group_file_path), "%s/%s", testcase_folder, group_paths[group_id]);
+    snprintf(group_file_path, sizeof(group_file_path), "%s/%s", testcase_folder, group_path);
     FILE* group_fp = fopen(group_file_path, "r");
     if (!group_fp) {
         fprintf(stderr, "Error opening group file %s: %s\n", group_file_path, strerror(errno));
@@ -270,11 +1927,11 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Error: Group %d specifies %d users, which exceeds the maximum of %d\n", group_id, M, MAX_USERS);
         exit(1);
     }
-    printf("Number of users in group %d: %d\n", group_id, M);
+    log_event(LOG_INFO, "Number of users in group %d: %d\n", NULL, group_id, M);
 
     char user_file[256];
     for (int i = 0; i < M; i++) {
-        if (fscanf(group_fp, "%s", user_file) != 1) {
+        if (fscanf(group_fp, "%255s", user_file) != 1) {
             fprintf(stderr, "Error reading user file path from group file\n");
             exit(1);
         }
@@ -284,17 +1941,238 @@ int main(int argc, char *argv[]) {
     }
 
     fclose(group_fp);
+}
+
+/* Thread-local state survives between groups run on the same pool thread. */
+static void reset_group_state(void) {
+    memset(moderators, 0, sizeof(moderators));
+    moderator_count = 1;
+    memset(&validation_outbox, 0, sizeof(validation_outbox));
+    throttled = 0;
+    epoll_fd = -1;
+    fd_table = NULL;
+    fd_table_size = 0;
+    live_children = 0;
+    sigchld_fd = -1;
+    ready_count = 0;
+    memset(&inbox, 0, sizeof(inbox));
+    batch_limit = BATCH_FRAME_BYTES;
+    memset(users, 0, sizeof(users));
+    user_count = 0;
+    free_slot_count = 0;
+    slots_used = 0;
+    mapped_users = 0;
+    removed_users = 0;
+    merge_lookahead = GROUP_MERGE_LOOKAHEAD;
+    merge_lateness = -1;
+    merge_idle_ns = GROUP_MERGE_IDLE_MS * 1000000LL;
+    merge_resumed_ns = 0;
+    merge_wait_ms = -1;
+    merge_newest = 0;
+    merge_heap_size = 0;
+    stats_segment = NULL;
+    stats = NULL;
+    chunk_read_ns = 0;
+    trace_file = NULL;
+    trace_records = 0;
+}
+
+/*
+ * Runs one group to completion. app.c's in-process runtime passes the
+ * snapshot it published; a groups.out process maps it by name, and only
+ * parses input.txt and its group file itself when there is none.
+ */
+int run_group(int id, int test_case, const struct ConfigSnapshot *snapshot) {
+    pthread_once(&line_parser_once, select_line_parser);
+    pthread_once(&logger_once, start_logger);
+    reset_group_state();
+    group_id = id;
+    in_process = snapshot != NULL;
+    printf("Starting group %d for test case %d\n", group_id, test_case);
+
+    char testcase_folder[256];
+    snprintf(testcase_folder, sizeof(testcase_folder), "testcase_%d", test_case);
+
+    const struct ConfigSnapshot *attached = NULL;
+    if (snapshot == NULL) {
+        snapshot = attached = attach_config_snapshot(testcase_folder, test_case);
+    }
+    struct ChatConfig parsed;
+    if (snapshot != NULL) {
+        parsed.n = snapshot->n;
+        parsed.validation_queue_key = snapshot->validation_queue_key;
+        parsed.app_groups_queue_key = snapshot->app_groups_queue_key;
+        parsed.moderator_groups_queue_key = snapshot->moderator_groups_queue_key;
+        parsed.threshold = snapshot->threshold;
+    } else {
+        load_config(testcase_folder, &parsed);
+    }
+    if (group_id < 0 || group_id >= parsed.n) {
+        fprintf(stderr, "Invalid group id %d for %d groups\n", group_id, parsed.n);
+        exit(1);
+    }
+    validation_queue_key = parsed.validation_queue_key;
+    app_groups_queue_key = parsed.app_groups_queue_key;
+    moderator_groups_queue_key = parsed.moderator_groups_queue_key;
+
+    /*
+     * MODERATOR_INSTANCES: app.c runs that many moderators, instance i on
+     * the moderator key plus i * MODERATOR_KEY_STRIDE, and each message
+     * goes to the one instance_of() picks for its user.
+     */
+    const char *instances = getenv("MODERATOR_INSTANCES");
+    if (instances != NULL) {
+        moderator_count = atoi(instances);
+        if (moderator_count < 1 || moderator_count > MAX_MODERATORS) {
+            fprintf(stderr, "Invalid MODERATOR_INSTANCES=%s (expected 1..%d)\n", instances, MAX_MODERATORS);
+            exit(1);
+        }
+    }
+
+    validation_queue_id = msgget(validation_queue_key, 0666);
+    app_groups_queue_id = msgget(app_groups_queue_key, 0666);
+    int moderators_connected = 1;
+    for (int i = 0; i < moderator_count; i++) {
+        int key = moderator_groups_queue_key + i * MODERATOR_KEY_STRIDE;
+        moderators[i].queue_id = msgget(key, 0666);
+        moderators[i].verdict_queue_id = msgget(key + VERDICT_KEY_OFFSET, IPC_CREAT | 0666);
+        moderators_connected &= moderators[i].queue_id != -1 && moderators[i].verdict_queue_id != -1;
+    }
+
+    if (validation_queue_id == -1 || app_groups_queue_id == -1 || !moderators_connected) {
+        fprintf(stderr, "Error connecting to message queues: %s\n", strerror(errno));
+        exit(1);
+    }
+    printf("Connected to all message queues successfully\n");
+
+    stats_segment = attach_stats(test_case);
+    if (stats_segment != NULL) {
+        stats = &stats_segment->groups[group_id];
+        memset(stats, 0, sizeof(*stats));
+        stats->pid = getpid();
+        __atomic_store_n(&stats->active, 1, __ATOMIC_RELEASE);
+    }
+
+    const char *transport = getenv("CHAT_TRANSPORT");
+    if (transport != NULL && strcmp(transport, "shm") == 0) {
+        for (int i = 0; i < moderator_count; i++) {
+            attach_bus(&moderators[i], moderator_groups_queue_key + i * MODERATOR_KEY_STRIDE);
+        }
+    }
+
+    send_validation_message(1, 0);
+
+    /* GROUP_INGEST=mmap reads user files in-process; the default forks a writer per user. */
+    const char *ingest = getenv("GROUP_INGEST");
+    ingest_mapped = ingest != NULL && strcmp(ingest, "mmap") == 0;
+
+    /* GROUP_TRACE=<dir> records what the group sends, for replay.out. */
+    const char *trace_dir = getenv("GROUP_TRACE");
+    if (trace_dir != NULL) {
+        start_trace(trace_dir);
+    }
+
+    /*
+     * Messages are sent as they are read. GROUP_MERGE=on turns on the
+     * ordering stage, which sends each group's messages in timestamp order:
+     * GROUP_MERGE_LOOKAHEAD bounds the lines held per user and
+     * GROUP_MERGE_LATENESS (in timestamp units) releases lines that far
+     * behind the newest one without waiting for slow users. A user that has
+     * sent nothing for GROUP_MERGE_IDLE_MS (wall clock, 50 by default, "off"
+     * to wait forever) stops holding the others back until it sends again.
+     */
+    const char *merge = getenv("GROUP_MERGE");
+    merge_enabled = merge != NULL && strcmp(merge, "on") == 0;
+    const char *lookahead = getenv("GROUP_MERGE_LOOKAHEAD");
+    if (lookahead != NULL) {
+        merge_lookahead = atoi(lookahead);
+        if (merge_lookahead < 1 || merge_lookahead > 65536) {
+            fprintf(stderr, "Invalid GROUP_MERGE_LOOKAHEAD=%s (expected 1..65536)\n", lookahead);
+            exit(1);
+        }
+    }
+    const char *lateness = getenv("GROUP_MERGE_LATENESS");
+    if (lateness != NULL) {
+        merge_lateness = atoll(lateness);
+        if (merge_lateness < 0) {
+            fprintf(stderr, "Invalid GROUP_MERGE_LATENESS=%s\n", lateness);
+            exit(1);
+        }
+    }
+    const char *idle = getenv("GROUP_MERGE_IDLE_MS");
+    if (idle != NULL) {
+        if (strcmp(idle, "off") == 0) {
+            merge_idle_ns = -1;
+        } else if (atoi(idle) >= 0) {
+            merge_idle_ns = atoi(idle) * 1000000LL;
+        } else {
+            fprintf(stderr, "Invalid GROUP_MERGE_IDLE_MS=%s\n", idle);
+            exit(1);
+        }
+    }
+
+    init_event_loop();
+
+    if (snapshot != NULL) {
+        add_users_from_snapshot(snapshot);
+    } else {
+        add_users_from_group_file(testcase_folder, parsed.group_paths[group_id]);
+    }
 
     process_user_messages();
+    close_moderator_links();
+    stop_verdict_listener();
+    if (trace_file) {
+        finish_trace();
+    }
+
+    /* Everything validation has not taken yet goes in before the group reports it is done. */
+    outbox_drain(validation_queue_id, &validation_outbox, 1, "validation");
+
+    /* mtype must be positive, so group 0 would be rejected as plain group_id. */
     struct AppMessage terminate_msg;
-    terminate_msg.mtype = group_id;
+    terminate_msg.mtype = group_id + 1;
     terminate_msg.group_id = group_id;
 
     if (msgsnd(app_groups_queue_id, &terminate_msg, sizeof(struct AppMessage) - sizeof(long), 0) == -1) {
     fprintf(stderr, "Error sending termination message: %s\n", strerror(errno));
 }
     send_validation_message(3, removed_users);
-    printf("Group %d terminated. Total removed users: %d\n", group_id, removed_users);
+    outbox_drain(validation_queue_id, &validation_outbox, 1, "validation");
+    log_event(LOG_INFO, "Group %d terminated. Total removed users: %d\n", NULL, group_id, removed_users);
+    log_flush();
 
+    close(epoll_fd);
+    free(fd_table);
+    for (int slot = 0; slot < slots_used; slot++) {
+        free(users[slot].pending);
+        free(users[slot].overflow);
+    }
+    for (int i = 0; i < moderator_count; i++) {
+        if (moderators[i].bus != NULL) {
+            shmdt(moderators[i].bus);
+        }
+        free(moderators[i].outbox.data);
+    }
+    free(validation_outbox.data);
+    if (attached != NULL) {
+        munmap((void *)attached, attached->size);
+    }
+    if (stats_segment != NULL) {
+        __atomic_store_n(&stats->active, 0, __ATOMIC_RELEASE);
+        munmap(stats_segment, sizeof(struct StatsSegment));
+    }
     return 0;
 }
+
+/* Built with -DGROUPS_NO_MAIN, this file links into app.out for GROUP_THREADS. */
+#ifndef GROUPS_NO_MAIN
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <group_id> <test_case_number>\n", argv[0]);
+        exit(1);
+    }
+
+    return run_group(atoi(argv[1]), atoi(argv[2]), NULL);
+}
+#endif
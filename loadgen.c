@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define MAX_USERS 50
+#define MAX_GROUPS 30
+#define MAX_MESSAGE_LENGTH 256
+#define MAX_TIMESTAMP 2147000000
+
+/*
+ * Writes a synthetic testcase_<N> folder in the layout app.out, groups.out
+ * and moderator.out read:
+ *
+ *   input.txt            n, the three queue keys, the threshold, group paths
+ *   groups/group_G.txt   user count and user file paths
+ *   users/user_G_U.txt   "<timestamp> <text>" lines
+ *   filtered_words.txt   one word per line
+ *
+ * Filtered words all start with "zq", which no filler word contains, so the
+ * share of messages carrying a violation is exactly what -d asks for. Every
+ * message text is unique ("m<group>.<user>.<seq> ..."), which lets bench.out
+ * match a message on both sides of the pipeline. The output only depends on
+ * the options and the seed.
+ */
+
+static const char *filler[] = {
+    "hello", "world", "message", "from", "the", "chat", "group", "about",
+    "meeting", "later", "today", "tomorrow", "lunch", "project", "update",
+    "review", "thanks", "please", "check", "this", "link", "sounds", "good",
+    "see", "you", "soon", "weekend", "plans", "coffee", "deadline",
+};
+
+struct Options {
+    int test_case;
+    int groups;
+    int users;
+    int messages;
+    int words;
+    double density;
+    int threshold;
+    int key;
+    unsigned int seed;
+};
+
+static unsigned long long rng_state;
+
+static unsigned int next_random(void) {
+    rng_state = rng_state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (unsigned int)(rng_state >> 33);
+}
+
+static void make_dir(const char *path) {
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Error creating %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+}
+
+static FILE *create_file(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Error creating %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    return file;
+}
+
+static void close_file(FILE *file, const char *path) {
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Error writing %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s <test_case_number> [-g groups] [-u users_per_group] [-m messages_per_user]\n"
+            "          [-w filtered_words] [-d violation_density] [-t threshold] [-k base_key] [-s seed]\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    struct Options opt = {
+        .groups = 3,
+        .users = 3,
+        .messages = 100,
+        .words = 10,
+        .density = 0.1,
+        .threshold = 5,
+        .key = 7001,
+        .seed = 1,
+    };
+
+    int c;
+    while ((c = getopt(argc, argv, "g:u:m:w:d:t:k:s:")) != -1) {
+        switch (c) {
+        case 'g': opt.groups = atoi(optarg); break;
+        case 'u': opt.users = atoi(optarg); break;
+        case 'm': opt.messages = atoi(optarg); break;
+        case 'w': opt.words = atoi(optarg); break;
+        case 'd': opt.density = atof(optarg); break;
+        case 't': opt.threshold = atoi(optarg); break;
+        case 'k': opt.key = atoi(optarg); break;
+        case 's': opt.seed = strtoul(optarg, NULL, 10); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+    opt.test_case = atoi(argv[optind]);
+
+    if (opt.groups < 1 || opt.users < 0 || opt.messages < 0 || opt.words < 1 ||
+        opt.density < 0 || opt.density > 1 || opt.threshold < 1) {
+        fprintf(stderr, "Invalid generator options\n");
+        exit(1);
+    }
+    if ((long long)opt.messages * (opt.groups * (long long)opt.users + 1) > MAX_TIMESTAMP) {
+        fprintf(stderr, "Too many messages: timestamps would exceed %d\n", MAX_TIMESTAMP);
+        exit(1);
+    }
+    /* Oversized configurations are allowed on purpose, to exercise the limits. */
+    if (opt.groups > MAX_GROUPS) {
+        printf("Note: %d groups exceeds MAX_GROUPS (%d); app.out will reject this testcase\n", opt.groups, MAX_GROUPS);
+    }
+    if (opt.users > MAX_USERS) {
+        printf("Note: %d users per group exceeds MAX_USERS (%d); app.out will reject this testcase\n", opt.users, MAX_USERS);
+    }
+    rng_state = opt.seed;
+
+    char folder[256], path[512];
+    snprintf(folder, sizeof(folder), "testcase_%d", opt.test_case);
+    make_dir(folder);
+    snprintf(path, sizeof(path), "%s/groups", folder);
+    make_dir(path);
+    snprintf(path, sizeof(path), "%s/users", folder);
+    make_dir(path);
+
+    char (*words)[16] = malloc((size_t)opt.words * sizeof(*words));
+    if (words == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    snprintf(path, sizeof(path), "%s/filtered_words.txt", folder);
+    FILE *file = create_file(path);
+    for (int i = 0; i < opt.words; i++) {
+        int len = 3 + next_random() % 6;
+        strcpy(words[i], "zq");
+        for (int j = 0; j < len; j++) {
+            words[i][2 + j] = 'a' + next_random() % 26;
+        }
+        words[i][2 + len] = '\0';
+        fprintf(file, "%s\n", words[i]);
+    }
+    close_file(file, path);
+
+    snprintf(path, sizeof(path), "%s/input.txt", folder);
+    file = create_file(path);
+    fprintf(file, "%d\n%d\n%d\n%d\n%d\n", opt.groups, opt.key, opt.key + 1, opt.key + 2, opt.threshold);
+    for (int g = 0; g < opt.groups; g++) {
+        fprintf(file, "groups/group_%d.txt\n", g);
+    }
+    close_file(file, path);
+
+    int total_users = opt.groups * opt.users;
+    long long total_messages = 0, violating = 0;
+    int filler_count = sizeof(filler) / sizeof(filler[0]);
+    for (int g = 0; g < opt.groups; g++) {
+        snprintf(path, sizeof(path), "%s/groups/group_%d.txt", folder, g);
+        file = create_file(path);
+        fprintf(file, "%d\n", opt.users);
+        for (int u = 0; u < opt.users; u++) {
+            fprintf(file, "users/user_%d_%d.txt\n", g, u);
+        }
+        close_file(file, path);
+
+        for (int u = 0; u < opt.users; u++) {
+            snprintf(path, sizeof(path), "%s/users/user_%d_%d.txt", folder, g, u);
+            FILE *user_file = create_file(path);
+            for (int m = 0; m < opt.messages; m++) {
+                char text[MAX_MESSAGE_LENGTH];
+                int len = snprintf(text, sizeof(text), "m%d.%d.%d", g, u, m);
+                int filler_words = 3 + next_random() % 10;
+                int bad_at = next_random() % 1000000 < opt.density * 1000000 ? (int)(next_random() % filler_words) : -1;
+                for (int w = 0; w < filler_words && len < (int)sizeof(text) - 24; w++) {
+                    const char *word = filler[next_random() % filler_count];
+                    if (w == bad_at) {
+                        word = words[next_random() % opt.words];
+                        violating++;
+                    }
+                    len += snprintf(text + len, sizeof(text) - len, " %s", word);
+                }
+                /* Timestamps are unique and increase with m across all users. */
+                long long timestamp = (long long)m * total_users + g * opt.users + u + 1;
+                fprintf(user_file, "%lld %s\n", timestamp, text);
+                total_messages++;
+            }
+            close_file(user_file, path);
+        }
+    }
+    free(words);
+
+    printf("Wrote %s: %d groups, %d users, %lld messages (%lld with a filtered word), %d filtered words, threshold %d\n",
+           folder, opt.groups, total_users, total_messages, violating, opt.words, opt.threshold);
+    return 0;
+}
@@ -6,13 +6,63 @@
 #include <sys/ipc.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/shm.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <time.h>
+#include <stddef.h>
 
-#define MAX_FILTERED_WORDS 50
-#define MAX_WORD_LENGTH 20
 #define MAX_MESSAGE_LENGTH 256
 #define MAX_USERS 50
 #define MAX_GROUPS 30
 #define MAX_TIMESTAMP 2147000000
+#define MAX_WORKERS 64
+#define MAX_MODERATORS 8
+#define MODERATOR_KEY_STRIDE 0x10000
+#define MODERATOR_STOP_MTYPE (3 * MAX_GROUPS)
+#define VERDICT_KEY_OFFSET 0x8000
+#define VERDICT_MTYPE_BASE 1
+#define VERDICT_CLOSE_USER -2
+#define SHARD_QUEUE_SIZE 1024
+#define BUS_RING_SLOTS 4096
+#define BATCH_MTYPE_BASE (2 * MAX_GROUPS)
+#define BATCH_FRAME_BYTES 8192
+#define BATCH_ACK_USER -1
+#define CONFIG_SNAPSHOT_MAGIC 0x47464343
+#define CONFIG_SNAPSHOT_VERSION 1
+#define FILTER_IMAGE_MAGIC 0x4d494643
+#define FILTER_IMAGE_VERSION 2
+#define NORMALIZE_LEET 1
+#define NORMALIZE_SEPARATORS 2
+#define NORMALIZE_REPEATS 4
+#define STATE_LOG_MAGIC 0x474f4c56
+#define STATE_SNAPSHOT_MAGIC 0x504e5356
+#define STATE_SNAPSHOT_VERSION 2
+#define STATE_COMMIT_MS 5
+#define STATE_SNAPSHOT_RECORDS 65536
+#define SCORE_TOTAL 0
+#define SCORE_WINDOW 1
+#define SCORE_DECAY 2
+#define SCORE_BUCKETS 16
+#define SCORE_SWEEP 2
+#define SCORE_EVICT_FLOOR (1.0 / 64)
+#define VIOLATION_TABLE_MIN 1024
+#define COUNT_CACHE_BUCKETS 1024
+#define QUERY_KEY_OFFSET 0x4000
+#define QUERY_REQUEST_MTYPE 1
+#define QUERY_TOP_K 16
+#define QUERY_POLL_MS 10
+#define QUERY_RATE_MS 1000
+#define COUNT_CACHE_WAYS 4
+#define STATS_MAGIC 0x54534843
+#define STATS_VERSION 3
+#define STATS_BUCKETS 256
+#define STATS_SAMPLE_MS 10
 
 typedef struct {
     long mtype;
@@ -22,92 +72,2621 @@ typedef struct {
     int modifyingGroup;
 } Message;
 
-struct FilteredWord {
-    char word[MAX_WORD_LENGTH];
+/*
+ * Several messages from one group packed into one queue message
+ * (mtype BATCH_MTYPE_BASE + group). Each record is a BatchRecordHeader
+ * followed by len bytes of text, without a terminating NUL. Groups only
+ * send batches after this moderator has acknowledged the format (a verdict
+ * with user BATCH_ACK_USER), so a moderator that never acknowledges keeps
+ * getting plain Messages. Layout must match groups.c.
+ */
+struct BatchRecordHeader {
+    int timestamp;
+    int user;
+    unsigned short len;
+} __attribute__((packed));
+
+struct BatchFrame {
+    long mtype;
+    int group;
+    int count;
+    char data[BATCH_FRAME_BYTES];
+};
+
+union QueueFrame {
+    long mtype;
+    Message msg;
+    struct BatchFrame batch;
+};
+
+/* Shared group -> moderator ring (CHAT_TRANSPORT=shm); see groups.c. */
+struct BusSlot {
+    unsigned int seq;
+    Message msg;
 };
 
-struct UserViolations {
-    int group_id;
-    int user_id;
-    int violations;
-};
+struct BusRing {
+    unsigned int head;
+    char head_pad[60];
+    unsigned int tail;
+    char tail_pad[60];
+    unsigned int consumer_waiting;
+    unsigned int producers_waiting;
+    char wait_pad[56];
+    struct BusSlot slots[BUS_RING_SLOTS];
+};
+
+/*
+ * Case-insensitive Aho-Corasick automaton over the filtered word list.
+ * Bytes are folded into equivalence classes (every byte that never appears
+ * in a word shares class 0), so the dense transition table is
+ * state_count * class_count ints instead of state_count * 256. The
+ * MODERATOR_NORMALIZE rules are folded into the same tables when it is
+ * built (see matcher_build()), so they cost nothing per message.
+ */
+struct Matcher {
+    int state_count;
+    int state_capacity;
+    int class_count;
+    unsigned char byte_class[256];
+    int *transitions;
+    int *fail;
+    int *dict_link;
+    int *word_count;
+    int total_words;
+    /* The NORMALIZE_* rules the tables were built with. */
+    int normalize;
+    /* Set when the tables point into a mapped image rather than the heap. */
+    void *image;
+    size_t image_size;
+};
+
+/*
+ * On-disk form of a built Matcher (filtered_words.img, written by
+ * "moderator.out --compile-filter"). The header is followed by the
+ * transition table (state_count * class_count ints), then dict_link and
+ * word_count (state_count ints each), so the moderator can map the file
+ * and match against it directly.
+ */
+struct FilterImageHeader {
+    unsigned int magic;
+    unsigned int version;
+    int state_count;
+    int class_count;
+    int total_words;
+    /* The NORMALIZE_* rules the tables were built with. */
+    int normalize;
+    unsigned char byte_class[256];
+};
+
+/*
+ * Persistent violation state (MODERATOR_STATE_DIR). violations.log holds one
+ * record per scored message that added violations; violations.snap is a
+ * compacted image of all scores up to last_seq, after which the log is
+ * truncated. Records at or below the snapshot's last_seq are skipped on
+ * replay, so a crash between writing the snapshot and truncating the log
+ * does not count anything twice. Records carry the message timestamp, so
+ * replaying them rebuilds windowed and decayed scores exactly.
+ */
+struct StateLogRecord {
+    unsigned long long seq;
+    int group_id;
+    int user_id;
+    int delta;
+    int timestamp;
+    unsigned int check;
+    int pad;
+};
+
+/* Version 1 of the log, before records carried the timestamp; still replayed. */
+struct StateLogRecordV1 {
+    unsigned long long seq;
+    int group_id;
+    int user_id;
+    int delta;
+    unsigned int check;
+};
+
+struct StateSnapshotEntry {
+    int group_id;
+    int user_id;
+    int violations;
+    int last_timestamp;
+    double decayed;
+    int buckets[SCORE_BUCKETS];
+};
+
+/* Version 1 snapshots hold plain totals, as if kept under SCORE_TOTAL. */
+struct StateSnapshotEntryV1 {
+    int group_id;
+    int user_id;
+    int violations;
+};
+
+struct StateSnapshotHeader {
+    unsigned int magic;
+    unsigned int version;
+    unsigned long long last_seq;
+    int count;
+    /* The scoring policy and span the entries were kept under (0 in version 1). */
+    int policy;
+    /* Version 2 only; version 1 entries start here. */
+    int span;
+    int pad;
+};
+
+/* Per-thread "already counted in this message" marks, one per automaton state. */
+struct MatchScratch {
+    unsigned int *seen;
+    int capacity;
+    unsigned int stamp;
+};
+
+/*
+ * Per-shard cache of violation counts (MODERATOR_CACHE, on by default), so
+ * that a flood of one text costs a hash and a lookup instead of a scan. The
+ * key is a hash of the text as the matcher sees it, its byte classes, so
+ * case and leet variants share an entry; two texts with the same classes
+ * drive the automaton identically. Hash and length pick the entry and its
+ * stored classes must then match the text's, so a collision can only cost
+ * a scan, never a wrong count; the hash is seeded per process all the same.
+ * Each bucket is one cache line of COUNT_CACHE_WAYS entries, most recently
+ * used first; the classes live in a separate array, in the row the entry
+ * owns, so reordering a bucket moves 16 bytes per entry. The cache is
+ * emptied when the shard meets a reloaded filter.
+ */
+struct CachedCount {
+    unsigned long long hash;
+    unsigned short len;
+    /* Row of the bucket's COUNT_CACHE_WAYS rows in CountCache.texts. */
+    unsigned short text;
+    int violations;
+};
+
+struct CountCacheBucket {
+    struct CachedCount ways[COUNT_CACHE_WAYS];
+} __attribute__((aligned(64)));
+
+struct CountCache {
+    struct CountCacheBucket *buckets;
+    /* COUNT_CACHE_WAYS rows of byte classes per bucket. */
+    unsigned char (*texts)[MAX_MESSAGE_LENGTH];
+    const struct Matcher *matcher;
+    unsigned long epoch;
+    unsigned long long lookups;
+    unsigned long long hits;
+};
+
+struct UserViolations {
+    int group_id;
+    int user_id;
+    /* The score compared against the threshold; see update_violations(). */
+    int violations;
+    int occupied;
+    /* Newest timestamp scored for this user. */
+    int last_timestamp;
+    /* SCORE_DECAY: the score as of last_timestamp, before rounding down. */
+    double decayed;
+    /* SCORE_WINDOW: violations per bucket, indexed by bucket number % SCORE_BUCKETS. */
+    int buckets[SCORE_BUCKETS];
+    /*
+     * Position in the group's ranking, in a ranked table: below QUERY_TOP_K
+     * in its top heap, otherwise QUERY_TOP_K plus the place in the rest.
+     */
+    int rank;
+};
+
+struct RankedUser {
+    int user_id;
+    int score;
+};
+
+/*
+ * A group's users split in two heaps: its QUERY_TOP_K best scores in a
+ * min-heap, so the weakest of them is at top[0], and everyone else in a
+ * max-heap, so the best contender is at rest[0]. See rank_user().
+ */
+struct GroupRanking {
+    struct RankedUser top[QUERY_TOP_K];
+    int top_count;
+    struct RankedUser *rest;
+    int rest_count;
+    int rest_capacity;
+};
+
+/*
+ * Open-addressing (linear probing) table keyed by (group_id, user_id).
+ * Under a windowed or decaying policy a sweep cursor walks the slots a
+ * couple at a time and evicts users whose score has run out.
+ */
+struct ViolationTable {
+    struct UserViolations *slots;
+    int capacity;
+    int count;
+    /*
+     * Newest timestamp scored per group. Groups are not in step with each
+     * other (and only send in timestamp order with GROUP_MERGE=on in
+     * groups.c), so a user only expires against their own group's clock.
+     */
+    int now[MAX_GROUPS];
+    /* Whether now[] holds a timestamp yet; timestamps may be negative. */
+    unsigned char clocked[MAX_GROUPS];
+    unsigned int sweep;
+    /* Shard tables keep a ranking per group and publish its top for queries. */
+    int ranked;
+    struct GroupRanking ranking[MAX_GROUPS];
+};
+
+/*
+ * The QUERY_TOP_K best-scored users of one group, in no particular order
+ * (answer_query() sorts them), published by the shard
+ * that owns the group under a sequence lock (odd while it writes), so the
+ * query thread reads it without ever holding up scoring.
+ */
+struct TopBoard {
+    unsigned int seq;
+    int count;
+    struct RankedUser users[QUERY_TOP_K];
+};
+
+/* Per-group counters for the query channel; each is written by the group's shard only. */
+struct GroupActivity {
+    unsigned long long messages;
+    unsigned long long violations;
+    unsigned long long removals;
+};
+
+/*
+ * A shard owns every group with modifyingGroup % worker_count == index, so
+ * all messages of one user are scored by the same thread, in arrival order,
+ * against violation state no other thread touches. The ring is the only
+ * thing shared with the receiving thread.
+ */
+struct Shard {
+    int index;
+    struct ViolationTable violations;
+    struct MatchScratch scratch;
+    struct CountCache cache;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    Message ring[SHARD_QUEUE_SIZE];
+    long long received_ns[SHARD_QUEUE_SIZE];
+    int head;
+    int count;
+    /* Set while the worker is processing a message it took off the ring. */
+    int busy;
+    /* Matcher epoch this shard is reading under, or 0 between messages. */
+    unsigned long reader_epoch;
+    /*
+     * With MODERATOR_STATE_DIR: held while a message is scored, so the table
+     * and wal always agree, and by the state writer to take the wal or,
+     * for a snapshot, to copy the table.
+     */
+    pthread_mutex_t state_lock;
+    /* Records scored since the writer last took them, in order. */
+    struct StateLogRecord *wal;
+    int wal_count;
+    int wal_capacity;
+    /* The writer's spare buffer, swapped with wal on every commit. */
+    struct StateLogRecord *wal_spare;
+    int wal_spare_count;
+    int wal_spare_capacity;
+};
+
+/*
+ * Live statistics, published in the POSIX shared-memory object
+ * /chat-stats-<test_case> and read by stats.out. Each group owns its
+ * GroupStats slot and the moderator owns the rest; every field has a
+ * single writer and is updated with relaxed atomics, so readers never
+ * block the pipeline and at worst see a sample that is one update old.
+ * Latencies are HDR-style log-linear histograms in nanoseconds: values
+ * below 8 get a bucket each, then every power of two is split into 8
+ * buckets, up to about 17 s. Layout must match groups.c, moderator.c
+ * and stats.c.
+ */
+struct LatencyHistogram {
+    unsigned long long count;
+    unsigned long long sum_ns;
+    unsigned long long max_ns;
+    unsigned long long buckets[STATS_BUCKETS];
+};
+
+struct GroupStats {
+    int active;
+    int pid;
+    unsigned long long bytes_read;
+    unsigned long long lines;
+    unsigned long long parse_errors;
+    unsigned long long messages_sent;
+    unsigned long long verdicts;
+    unsigned long long users_removed;
+    unsigned long long throttled_sends;
+    struct LatencyHistogram read_to_parse;
+    struct LatencyHistogram parse_to_send;
+    struct LatencyHistogram verdict_to_remove;
+};
+
+struct ModeratorGroupStats {
+    unsigned long long received;
+    /* Messages whose count came from the shard's cache. */
+    unsigned long long duplicates;
+    unsigned long long violations;
+    unsigned long long removals;
+    struct LatencyHistogram receive_to_verdict;
+};
+
+struct QueueDepth {
+    unsigned long long messages;
+    unsigned long long bytes;
+    unsigned long long max_messages;
+};
+
+struct StatsSegment {
+    unsigned int magic;
+    unsigned int version;
+    struct GroupStats groups[MAX_GROUPS];
+    int moderator_pid;
+    int moderator_active;
+    unsigned long long sampled_ns;
+    struct QueueDepth moderator_queue;
+    struct QueueDepth validation_queue;
+    struct QueueDepth bus;
+    struct QueueDepth verdict_queue;
+    struct ModeratorGroupStats moderator[MAX_GROUPS];
+};
+
+#include "chatlog.c"
+
+/*
+ * Pre-parsed configuration published by app.c as /chat-config-<test_case>;
+ * only the header is used here. Layout must match app.c.
+ */
+struct ConfigSnapshotGroup {
+    unsigned int path;
+    int user_count;
+    unsigned int users;
+};
+
+struct ConfigSnapshot {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int size;
+    int test_case;
+    unsigned long long input_dev;
+    unsigned long long input_ino;
+    long long input_size;
+    long long input_mtime_ns;
+    int n;
+    int validation_queue_key;
+    int app_groups_queue_key;
+    int moderator_groups_queue_key;
+    int threshold;
+    struct ConfigSnapshotGroup groups[MAX_GROUPS];
+};
+
+/*
+ * The matcher in use. A reload publishes a new one with an atomic swap;
+ * the old one is freed once every shard has left the epoch it was read in.
+ */
+struct Matcher *active_matcher;
+/* NORMALIZE_* rules from MODERATOR_NORMALIZE; see read_normalize_rules(). */
+int normalize_rules;
+unsigned long matcher_epoch = 1;
+char filter_folder[256];
+struct Shard *shards;
+int worker_count = 1;
+/* This process is moderator instance_index of instance_count; see instance_of(). */
+int instance_index = 0;
+int instance_count = 1;
+int threshold_violations;
+struct TopBoard top_boards[MAX_GROUPS];
+struct GroupActivity group_activity[MAX_GROUPS];
+
+/*
+ * Query channel (query.out): a request on the instance's key +
+ * QUERY_KEY_OFFSET, mtype QUERY_REQUEST_MTYPE, is answered on the same
+ * queue with mtype set to the client's pid. The reply carries the top k
+ * users of one group or of all groups, merged from the published
+ * TopBoards, and every group's counters with their rates over the last
+ * one to two seconds. Layout must match query.c.
+ */
+struct QueryRequest {
+    long mtype;
+    int client;
+    /* Echoed in the reply, so a client can tell it from a stale one. */
+    int id;
+    /* -1 for all groups. */
+    int group;
+    int k;
+};
+
+struct QueryUser {
+    int group_id;
+    int user_id;
+    int score;
+};
+
+struct QueryGroup {
+    unsigned long long messages;
+    unsigned long long violations;
+    unsigned long long removals;
+    double message_rate;
+    double violation_rate;
+};
+
+struct QueryReply {
+    long mtype;
+    int id;
+    int instance;
+    int instance_count;
+    int threshold;
+    int count;
+    struct QueryUser top[QUERY_TOP_K];
+    struct QueryGroup groups[MAX_GROUPS];
+};
+
+int query_msgid = -1;
+
+/*
+ * Scoring policy (MODERATOR_SCORING). total: violations add up forever.
+ * window:<span>: only violations from roughly the last <span> timestamp
+ * units count, kept in SCORE_BUCKETS buckets of scoring_span each.
+ * decay:<half_life>: a violation's weight halves every scoring_span units.
+ * Both cost O(1) per message and evict users whose score has run out.
+ */
+int scoring_policy = SCORE_TOTAL;
+int scoring_span;
+int moderator_msgid;
+/*
+ * Verdicts and batch offers go back on a queue of their own (the instance's
+ * key + VERDICT_KEY_OFFSET), with mtype VERDICT_MTYPE_BASE + group so that
+ * group 0 can be addressed too. Only the groups' listener threads read it,
+ * so a blocking msgsnd here waits for them and never for the groups' own
+ * sends. A group closes the channel by sending VERDICT_CLOSE_USER; it is
+ * echoed after every verdict for that group. Layout must match groups.c.
+ */
+int verdict_msgid;
+struct BusRing *bus = NULL;
+/* Whether the group's current run has been offered batching; cleared by its close. */
+int batching_offered[MAX_GROUPS];
+
+/*
+ * Deltas waiting for the state writer sit in each shard's wal (see struct
+ * Shard), so workers never wait for the disk or for each other; the writer
+ * swaps the buffers out, appends them to the log and makes them durable
+ * with one fdatasync per batch.
+ */
+int state_enabled;
+char state_dir[256];
+/* Held by whoever is committing; the shards' spare buffers and everything below belong to it. */
+pthread_mutex_t state_commit_lock = PTHREAD_MUTEX_INITIALIZER;
+int state_since_snapshot;
+int state_log_fd = -1;
+unsigned long long state_last_seq;
+/* Set when recovery read an older format or another policy; a snapshot rewrites it. */
+int state_needs_snapshot;
+struct StatsSegment *stats;
+int stats_validation_queue_key;
+
+static void *xrealloc(void *ptr, size_t size) {
+    void *p = realloc(ptr, size);
+    if (p == NULL) {
+        fprintf(stderr, "Out of memory building filter automaton\n");
+        exit(1);
+    }
+    return p;
+}
+
+static int matcher_new_state(struct Matcher *m) {
+    if (m->state_count == m->state_capacity) {
+        m->state_capacity = m->state_capacity ? m->state_capacity * 2 : 256;
+        m->transitions = xrealloc(m->transitions, (size_t)m->state_capacity * m->class_count * sizeof(int));
+        m->word_count = xrealloc(m->word_count, (size_t)m->state_capacity * sizeof(int));
+    }
+    int s = m->state_count++;
+    memset(&m->transitions[(size_t)s * m->class_count], 0xff, m->class_count * sizeof(int));
+    m->word_count[s] = 0;
+    return s;
+}
+
+static void matcher_add_word(struct Matcher *m, const char *word) {
+    int s = 0;
+    for (const unsigned char *p = (const unsigned char *)word; *p; p++) {
+        int *next = &m->transitions[(size_t)s * m->class_count + m->byte_class[*p]];
+        if (*next == -1) {
+            int t = matcher_new_state(m);
+            /* matcher_new_state may have moved the table */
+            next = &m->transitions[(size_t)s * m->class_count + m->byte_class[*p]];
+            *next = t;
+        }
+        s = *next;
+    }
+    m->word_count[s]++;
+    m->total_words++;
+}
+
+/*
+ * Fills in failure links and turns the trie into a full DFA (breadth-first),
+ * then adds the normalization edges:
+ *
+ *  - separator_class (punctuation no word uses) leaves every state as it
+ *    is, as if those bytes were not in the message: "b.a.d" reads "bad".
+ *  - NORMALIZE_REPEATS: a repeat of the letter that led into a state stays
+ *    in it, so "baaad" reads "bad", but only where the plain transition
+ *    would fall back to depth 1 or the root. Deeper targets are kept, so
+ *    every word that literally occurs is still found.
+ */
+static void matcher_build(struct Matcher *m, int separator_class) {
+    int n = m->state_count, k = m->class_count;
+    int *queue = xrealloc(NULL, (size_t)n * sizeof(int));
+    int *depth = xrealloc(NULL, (size_t)n * sizeof(int));
+    int *last_class = xrealloc(NULL, (size_t)n * sizeof(int));
+    m->fail = xrealloc(NULL, (size_t)n * sizeof(int));
+    m->dict_link = xrealloc(NULL, (size_t)n * sizeof(int));
+    int head = 0, tail = 0;
+    m->fail[0] = 0;
+    m->dict_link[0] = -1;
+    depth[0] = 0;
+    last_class[0] = -1;
+    for (int c = 0; c < k; c++) {
+        int t = m->transitions[c];
+        if (t == -1) {
+            m->transitions[c] = 0;
+        } else {
+            m->fail[t] = 0;
+            m->dict_link[t] = -1;
+            depth[t] = 1;
+            last_class[t] = c;
+            queue[tail++] = t;
+        }
+    }
+
+    while (head < tail) {
+        int s = queue[head++];
+        int *row = &m->transitions[(size_t)s * k];
+        const int *fail_row = &m->transitions[(size_t)m->fail[s] * k];
+        for (int c = 0; c < k; c++) {
+            int t = row[c];
+            if (t == -1) {
+                row[c] = fail_row[c];
+            } else {
+                int f = fail_row[c];
+                m->fail[t] = f;
+                m->dict_link[t] = m->word_count[f] ? f : m->dict_link[f];
+                depth[t] = depth[s] + 1;
+                last_class[t] = c;
+                queue[tail++] = t;
+            }
+        }
+    }
+
+    for (int s = 0; s < n; s++) {
+        int *row = &m->transitions[(size_t)s * k];
+        if (separator_class) {
+            row[separator_class] = s;
+        }
+        if ((m->normalize & NORMALIZE_REPEATS) && s != 0 && depth[row[last_class[s]]] <= 1) {
+            row[last_class[s]] = s;
+        }
+    }
+    free(queue);
+    free(depth);
+    free(last_class);
+}
+
+/* Letters and the digits and symbols folded into them by NORMALIZE_LEET. */
+static const char *leet_folds[] = {"a4@", "b8", "e3", "g6", "i1!|", "o0", "s5$", "t7+"};
+
+/* Case folding plus, with NORMALIZE_LEET, look-alike digits and symbols. */
+static void normalize_fold(unsigned char fold[256]) {
+    for (int c = 0; c < 256; c++) {
+        fold[c] = tolower(c);
+    }
+    if (normalize_rules & NORMALIZE_LEET) {
+        for (size_t i = 0; i < sizeof(leet_folds) / sizeof(leet_folds[0]); i++) {
+            for (const char *p = leet_folds[i] + 1; *p; p++) {
+                fold[(unsigned char)*p] = leet_folds[i][0];
+            }
+        }
+    }
+}
+
+/* Builds a matcher from a word list; returns NULL if the list cannot be read. */
+struct Matcher *compile_word_list(const char *filename) {
+    FILE* file = fopen(filename, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Error opening %s: %s\n", filename, strerror(errno));
+        return NULL;
+    }
+
+    /* First pass: assign a class to every (lowercased) byte used by a word. */
+    char **words = NULL;
+    int word_count = 0, word_capacity = 0;
+    char *word;
+    while (fscanf(file, "%ms", &word) == 1) {
+        if (word_count == word_capacity) {
+            word_capacity = word_capacity ? word_capacity * 2 : 64;
+            words = xrealloc(words, word_capacity * sizeof(char *));
+        }
+        words[word_count++] = word;
+    }
+    fclose(file);
+
+    struct Matcher *m = xrealloc(NULL, sizeof(*m));
+    memset(m, 0, sizeof(*m));
+    m->normalize = normalize_rules;
+    unsigned char fold[256];
+    normalize_fold(fold);
+    m->class_count = 1;
+    for (int i = 0; i < word_count; i++) {
+        for (unsigned char *p = (unsigned char *)words[i]; *p; p++) {
+            unsigned char c = fold[*p];
+            if (m->byte_class[c] == 0) {
+                m->byte_class[c] = m->class_count++;
+            }
+        }
+    }
+    for (int c = 0; c < 256; c++) {
+        m->byte_class[c] = m->byte_class[fold[c]];
+    }
+    int separator_class = 0;
+    if (normalize_rules & NORMALIZE_SEPARATORS) {
+        for (int c = 0; c < 256; c++) {
+            if (ispunct(fold[c]) && m->byte_class[c] == 0) {
+                if (separator_class == 0) {
+                    separator_class = m->class_count++;
+                }
+                m->byte_class[c] = separator_class;
+            }
+        }
+    }
+
+    matcher_new_state(m);
+    for (int i = 0; i < word_count; i++) {
+        matcher_add_word(m, words[i]);
+        free(words[i]);
+    }
+    free(words);
+    matcher_build(m, separator_class);
+    /* Failure links are only needed while building. */
+    free(m->fail);
+    m->fail = NULL;
+    return m;
+}
+
+/*
+ * Whether every table entry of a mapped image is in range, so matching
+ * against it can never read outside the mapping: each transition and byte
+ * class, each dict_link (-1 ends a chain), and word counts that add up to
+ * total_words.
+ */
+static int filter_image_valid(const struct FilterImageHeader *header, size_t states, size_t classes) {
+    const int *transitions = (const int *)(header + 1);
+    const int *dict_link = transitions + states * classes;
+    const int *word_count = dict_link + states;
+    for (int c = 0; c < 256; c++) {
+        if (header->byte_class[c] >= classes) {
+            return 0;
+        }
+    }
+    for (size_t i = 0; i < states * classes; i++) {
+        if (transitions[i] < 0 || (size_t)transitions[i] >= states) {
+            return 0;
+        }
+    }
+    long long words = 0;
+    for (size_t s = 0; s < states; s++) {
+        if (dict_link[s] < -1 || (dict_link[s] >= 0 && (size_t)dict_link[s] >= states) || word_count[s] < 0) {
+            return 0;
+        }
+        words += word_count[s];
+    }
+    return words == header->total_words;
+}
+
+/*
+ * Maps a compiled filter image. Returns NULL if it is missing, built with
+ * other normalization rules, or invalid: truncated, from another format
+ * version, or with a table entry out of range. *invalid is set only in
+ * the last case.
+ */
+struct Matcher *map_filter_image(const char *filename, int *invalid) {
+    *invalid = 0;
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct FilterImageHeader)) {
+        close(fd);
+        fprintf(stderr, "Ignoring invalid filter image %s\n", filename);
+        *invalid = 1;
+        return NULL;
+    }
+    void *image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        return NULL;
+    }
+
+    const struct FilterImageHeader *header = image;
+    size_t states = header->state_count > 0 ? header->state_count : 0;
+    size_t classes = header->class_count > 0 ? header->class_count : 0;
+    /* Classes are byte_class values, so at most 256; that also keeps the size below from overflowing. */
+    if (header->magic != FILTER_IMAGE_MAGIC || header->version != FILTER_IMAGE_VERSION ||
+        states == 0 || classes == 0 || classes > 256 ||
+        (size_t)st.st_size != sizeof(*header) + (states * classes + 2 * states) * sizeof(int) ||
+        !filter_image_valid(header, states, classes)) {
+        fprintf(stderr, "Ignoring invalid filter image %s\n", filename);
+        munmap(image, st.st_size);
+        *invalid = 1;
+        return NULL;
+    }
+    if (header->normalize != normalize_rules) {
+        printf("Ignoring filter image %s built with other normalization rules\n", filename);
+        munmap(image, st.st_size);
+        return NULL;
+    }
+
+    struct Matcher *m = xrealloc(NULL, sizeof(*m));
+    memset(m, 0, sizeof(*m));
+    m->state_count = header->state_count;
+    m->class_count = header->class_count;
+    m->total_words = header->total_words;
+    m->normalize = header->normalize;
+    memcpy(m->byte_class, header->byte_class, sizeof(m->byte_class));
+    m->transitions = (int *)(header + 1);
+    m->dict_link = m->transitions + states * classes;
+    m->word_count = m->dict_link + states;
+    m->image = image;
+    m->image_size = st.st_size;
+    return m;
+}
+
+/* Writes the image next to the list and renames it into place. */
+int write_filter_image(const struct Matcher *m, const char *filename) {
+    char tmp[512];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", filename) >= (int)sizeof(tmp)) {
+        fprintf(stderr, "Filter image path too long: %s\n", filename);
+        return -1;
+    }
+    FILE *file = fopen(tmp, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Error creating %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    struct FilterImageHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = FILTER_IMAGE_MAGIC;
+    header.version = FILTER_IMAGE_VERSION;
+    header.state_count = m->state_count;
+    header.class_count = m->class_count;
+    header.total_words = m->total_words;
+    header.normalize = m->normalize;
+    memcpy(header.byte_class, m->byte_class, sizeof(header.byte_class));
+    size_t states = m->state_count;
+    if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+        fwrite(m->transitions, sizeof(int), states * m->class_count, file) != states * m->class_count ||
+        fwrite(m->dict_link, sizeof(int), states, file) != states ||
+        fwrite(m->word_count, sizeof(int), states, file) != states ||
+        fflush(file) != 0 || fsync(fileno(file)) == -1) {
+        fprintf(stderr, "Error writing %s: %s\n", tmp, strerror(errno));
+        fclose(file);
+        unlink(tmp);
+        return -1;
+    }
+    fclose(file);
+    if (rename(tmp, filename) == -1) {
+        fprintf(stderr, "Error renaming %s: %s\n", tmp, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+void free_matcher(struct Matcher *m) {
+    if (m->image != NULL) {
+        munmap(m->image, m->image_size);
+    } else {
+        free(m->transitions);
+        free(m->dict_link);
+        free(m->word_count);
+    }
+    free(m);
+}
+
+/*
+ * Loads the filter for a test case: filtered_words.img when it is at least
+ * as new as filtered_words.txt, otherwise the word list itself. An invalid
+ * current image is rejected; with compile_on_bad_image the list is
+ * compiled instead, otherwise NULL is returned so a reload keeps the
+ * matcher it has.
+ */
+struct Matcher *load_filter(const char *testcase_folder, int compile_on_bad_image) {
+    char list_path[512], image_path[512];
+    snprintf(list_path, sizeof(list_path), "%s/filtered_words.txt", testcase_folder);
+    snprintf(image_path, sizeof(image_path), "%s/filtered_words.img", testcase_folder);
+
+    struct stat list_st, image_st;
+    int have_list = stat(list_path, &list_st) == 0;
+    struct Matcher *m = NULL;
+    int invalid = 0;
+    if (stat(image_path, &image_st) == 0 &&
+        (!have_list || image_st.st_mtim.tv_sec > list_st.st_mtim.tv_sec ||
+         (image_st.st_mtim.tv_sec == list_st.st_mtim.tv_sec && image_st.st_mtim.tv_nsec >= list_st.st_mtim.tv_nsec))) {
+        m = map_filter_image(image_path, &invalid);
+    }
+    if (invalid && !compile_on_bad_image) {
+        return NULL;
+    }
+    if (m != NULL) {
+        printf("Mapped filter image %s: ", image_path);
+    } else {
+        m = compile_word_list(list_path);
+        if (m == NULL) {
+            return NULL;
+        }
+        printf("Compiled %s: ", list_path);
+    }
+    printf("%d filtered words (%d states, %d byte classes)\n",
+           m->total_words, m->state_count, m->class_count);
+    return m;
+}
+
+/*
+ * Number of filtered words (counting duplicates in the list) that occur at
+ * least once in the message, case-insensitively. A word is only counted the
+ * first time its state is reached; since every state on a dictionary-link
+ * chain is marked when the chain is first walked, the walk stops at the first
+ * state already seen for this message.
+ */
+int count_violations(const struct Matcher *m, struct MatchScratch *scratch, const char* message) {
+    /* A reload may have swapped in a matcher with more states. */
+    if (scratch->capacity < m->state_count) {
+        free(scratch->seen);
+        scratch->seen = calloc(m->state_count, sizeof(unsigned int));
+        if (scratch->seen == NULL) {
+            fprintf(stderr, "Out of memory allocating match scratch\n");
+            exit(1);
+        }
+        scratch->capacity = m->state_count;
+        scratch->stamp = 0;
+    }
+    if (++scratch->stamp == 0) {
+        memset(scratch->seen, 0, (size_t)scratch->capacity * sizeof(unsigned int));
+        scratch->stamp = 1;
+    }
+
+    int violations = 0;
+    int s = 0;
+    const unsigned char *p = (const unsigned char *)message;
+    for (int i = 0; i < MAX_MESSAGE_LENGTH - 1 && p[i]; i++) {
+        s = m->transitions[(size_t)s * m->class_count + m->byte_class[p[i]]];
+        for (int t = m->word_count[s] ? s : m->dict_link[s]; t != -1 && scratch->seen[t] != scratch->stamp; t = m->dict_link[t]) {
+            scratch->seen[t] = scratch->stamp;
+            violations += m->word_count[t];
+        }
+    }
+
+    return violations;
+}
+
+unsigned long long count_cache_seed;
+
+/*
+ * Hashes the text's byte classes eight at a time and stores them in
+ * classes; *len gets the length count_violations() scans. The eight class
+ * lookups of a block are independent, so only the mixing is serial.
+ */
+static unsigned long long text_class_hash(const struct Matcher *m, const char *message, unsigned char *classes,
+                                          unsigned int *len) {
+    const unsigned char *p = (const unsigned char *)message;
+    const unsigned char *c = m->byte_class;
+    size_t n = strnlen(message, MAX_MESSAGE_LENGTH - 1);
+    unsigned long long hash = count_cache_seed ^ (unsigned long long)n << 56;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        unsigned long long word = (unsigned long long)c[p[i]] | (unsigned long long)c[p[i + 1]] << 8 |
+                                  (unsigned long long)c[p[i + 2]] << 16 | (unsigned long long)c[p[i + 3]] << 24 |
+                                  (unsigned long long)c[p[i + 4]] << 32 | (unsigned long long)c[p[i + 5]] << 40 |
+                                  (unsigned long long)c[p[i + 6]] << 48 | (unsigned long long)c[p[i + 7]] << 56;
+        memcpy(classes + i, &word, sizeof(word));
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 29;
+    }
+    unsigned long long tail = 0;
+    for (; i < n; i++) {
+        classes[i] = c[p[i]];
+        tail = tail << 8 | classes[i];
+    }
+    hash = (hash ^ tail) * 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 32;
+    *len = n;
+    /* 0 marks an empty way. */
+    return hash | 1;
+}
+
+/* count_violations() through the shard's cache; *hit says whether the scan was skipped. */
+int cached_violations(struct Shard *shard, const struct Matcher *m, unsigned long epoch, const char *message, int *hit) {
+    struct CountCache *cache = &shard->cache;
+    *hit = 0;
+    if (cache->buckets == NULL) {
+        return count_violations(m, &shard->scratch, message);
+    }
+    /* The epoch alone could pair old counts with a matcher swapped in after it was read. */
+    if (cache->matcher != m || cache->epoch != epoch) {
+        for (int b = 0; b < COUNT_CACHE_BUCKETS; b++) {
+            for (int w = 0; w < COUNT_CACHE_WAYS; w++) {
+                cache->buckets[b].ways[w].hash = 0;
+                cache->buckets[b].ways[w].text = w;
+            }
+        }
+        cache->matcher = m;
+        cache->epoch = epoch;
+    }
+
+    unsigned char classes[MAX_MESSAGE_LENGTH];
+    unsigned int len;
+    unsigned long long hash = text_class_hash(m, message, classes, &len);
+    unsigned int bucket = (hash >> 40) % COUNT_CACHE_BUCKETS;
+    struct CachedCount *ways = cache->buckets[bucket].ways;
+    unsigned char (*texts)[MAX_MESSAGE_LENGTH] = &cache->texts[bucket * COUNT_CACHE_WAYS];
+    cache->lookups++;
+    for (int w = 0; w < COUNT_CACHE_WAYS; w++) {
+        if (ways[w].hash == hash && ways[w].len == len && memcmp(texts[ways[w].text], classes, len) == 0) {
+            struct CachedCount found = ways[w];
+            memmove(&ways[1], &ways[0], w * sizeof(struct CachedCount));
+            ways[0] = found;
+            cache->hits++;
+            *hit = 1;
+            return found.violations;
+        }
+    }
+    int violations = count_violations(m, &shard->scratch, message);
+    /* The least recently used entry gives up its row. */
+    struct CachedCount evicted = ways[COUNT_CACHE_WAYS - 1];
+    memmove(&ways[1], &ways[0], (COUNT_CACHE_WAYS - 1) * sizeof(struct CachedCount));
+    ways[0].hash = hash;
+    ways[0].len = len;
+    ways[0].text = evicted.text;
+    ways[0].violations = violations;
+    memcpy(texts[evicted.text], classes, len);
+    return violations;
+}
+
+static unsigned int violation_hash(int group_id, int user_id) {
+    unsigned long long key = ((unsigned long long)(unsigned int)group_id << 32) | (unsigned int)user_id;
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (unsigned int)key;
+}
+
+static struct UserViolations *violation_slot(struct ViolationTable *table, int group_id, int user_id) {
+    unsigned int mask = table->capacity - 1;
+    unsigned int i = violation_hash(group_id, user_id) & mask;
+    while (table->slots[i].occupied &&
+           (table->slots[i].group_id != group_id || table->slots[i].user_id != user_id)) {
+        i = (i + 1) & mask;
+    }
+    return &table->slots[i];
+}
+
+static void violation_table_resize(struct ViolationTable *table, int capacity) {
+    struct ViolationTable resized = *table;
+    resized.capacity = capacity;
+    resized.sweep = 0;
+    resized.slots = calloc(resized.capacity, sizeof(struct UserViolations));
+    if (resized.slots == NULL) {
+        fprintf(stderr, "Out of memory resizing violation table\n");
+        exit(1);
+    }
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->slots[i].occupied) {
+            *violation_slot(&resized, table->slots[i].group_id, table->slots[i].user_id) = table->slots[i];
+        }
+    }
+    free(table->slots);
+    *table = resized;
+}
+
+/* 2 to the power -halvings, without pulling in libm. */
+static double decay_factor(double halvings) {
+    if (halvings <= 0) {
+        return 1;
+    }
+    if (halvings >= 64) {
+        return 0;
+    }
+    double factor = 1;
+    for (; halvings >= 1; halvings -= 1) {
+        factor *= 0.5;
+    }
+    /* e^(-x ln 2) for the fraction left, by its Taylor series. */
+    double x = -halvings * 0.6931471805599453, term = 1, sum = 1;
+    for (int k = 1; k < 16; k++) {
+        term *= x / k;
+        sum += term;
+    }
+    return factor * sum;
+}
+
+/* The window bucket a timestamp falls in, rounding down so negative timestamps get their own buckets. */
+static long long score_bucket(int timestamp) {
+    long long t = timestamp;
+    return t >= 0 ? t / scoring_span : -((-t + scoring_span - 1) / scoring_span);
+}
+
+/* Where bucket number b lives in UserViolations.buckets. */
+static int score_bucket_slot(long long b) {
+    return (int)((b % SCORE_BUCKETS + SCORE_BUCKETS) % SCORE_BUCKETS);
+}
+
+/* Moves the group's now forward to timestamp. */
+static void advance_group_clock(struct ViolationTable *table, int group_id, int timestamp) {
+    if (group_id < 0 || group_id >= MAX_GROUPS) {
+        return;
+    }
+    if (!table->clocked[group_id] || timestamp > table->now[group_id]) {
+        table->now[group_id] = timestamp;
+        table->clocked[group_id] = 1;
+    }
+}
+
+/* Whether the user's score has run out by their group's now, so forgetting them changes nothing. */
+static int violations_expired(const struct ViolationTable *table, const struct UserViolations *entry) {
+    if (entry->group_id < 0 || entry->group_id >= MAX_GROUPS || !table->clocked[entry->group_id]) {
+        return 0;
+    }
+    long long now = table->now[entry->group_id];
+    if (scoring_policy == SCORE_WINDOW) {
+        return entry->violations == 0 ||
+               score_bucket(now) - score_bucket(entry->last_timestamp) >= SCORE_BUCKETS;
+    }
+    return entry->decayed * decay_factor((double)(now - entry->last_timestamp) / scoring_span) < SCORE_EVICT_FLOOR;
+}
+
+static int is_ranked(const struct ViolationTable *table, int group_id) {
+    return table->ranked && group_id >= 0 && group_id < MAX_GROUPS;
+}
+
+static void publish_top(struct ViolationTable *table, int group_id) {
+    struct TopBoard *board = &top_boards[group_id];
+    const struct GroupRanking *list = &table->ranking[group_id];
+    int count = list->top_count;
+    unsigned int seq = board->seq;
+    __atomic_store_n(&board->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (int i = 0; i < count; i++) {
+        __atomic_store_n(&board->users[i].user_id, list->top[i].user_id, __ATOMIC_RELAXED);
+        __atomic_store_n(&board->users[i].score, list->top[i].score, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&board->count, count, __ATOMIC_RELAXED);
+    __atomic_store_n(&board->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Puts user at rank and records the rank in the user's entry. */
+static void rank_place(struct ViolationTable *table, int group_id, int rank, struct RankedUser user) {
+    struct GroupRanking *list = &table->ranking[group_id];
+    if (rank < QUERY_TOP_K) {
+        list->top[rank] = user;
+    } else {
+        list->rest[rank - QUERY_TOP_K] = user;
+    }
+    violation_slot(table, group_id, user.user_id)->rank = rank;
+}
+
+/* Whether score a belongs above b: the top heap keeps its lowest score first, the rest their highest. */
+static int rank_before(int in_top, int a, int b) {
+    return in_top ? a < b : a > b;
+}
+
+/*
+ * Restores the heap order around the user at rank after its score changed.
+ * Equal scores stop the walk, so ties cost nothing however many there are.
+ */
+static void rank_sift(struct ViolationTable *table, int group_id, int rank) {
+    struct GroupRanking *list = &table->ranking[group_id];
+    int in_top = rank < QUERY_TOP_K;
+    int base = in_top ? 0 : QUERY_TOP_K;
+    struct RankedUser *heap = in_top ? list->top : list->rest;
+    int count = in_top ? list->top_count : list->rest_count;
+    int i = rank - base;
+    struct RankedUser user = heap[i];
+    while (i > 0 && rank_before(in_top, user.score, heap[(i - 1) / 2].score)) {
+        rank_place(table, group_id, base + i, heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    while (2 * i + 1 < count) {
+        int child = 2 * i + 1;
+        if (child + 1 < count && rank_before(in_top, heap[child + 1].score, heap[child].score)) {
+            child++;
+        }
+        if (!rank_before(in_top, heap[child].score, user.score)) {
+            break;
+        }
+        rank_place(table, group_id, base + i, heap[child]);
+        i = child;
+    }
+    rank_place(table, group_id, base + i, user);
+}
+
+static void rank_push(struct ViolationTable *table, int group_id, int in_top, struct RankedUser user) {
+    struct GroupRanking *list = &table->ranking[group_id];
+    int rank;
+    if (in_top) {
+        rank = list->top_count++;
+    } else {
+        if (list->rest_count == list->rest_capacity) {
+            list->rest_capacity = list->rest_capacity ? list->rest_capacity * 2 : 64;
+            list->rest = realloc(list->rest, list->rest_capacity * sizeof(struct RankedUser));
+            if (list->rest == NULL) {
+                fprintf(stderr, "Out of memory growing ranking\n");
+                exit(1);
+            }
+        }
+        rank = QUERY_TOP_K + list->rest_count++;
+    }
+    rank_place(table, group_id, rank, user);
+    rank_sift(table, group_id, rank);
+}
+
+/* Takes the user at rank out of its heap, filling the gap with the heap's last user. */
+static struct RankedUser rank_take(struct ViolationTable *table, int group_id, int rank) {
+    struct GroupRanking *list = &table->ranking[group_id];
+    int in_top = rank < QUERY_TOP_K;
+    struct RankedUser *heap = in_top ? list->top : list->rest;
+    int *count = in_top ? &list->top_count : &list->rest_count;
+    int i = rank - (in_top ? 0 : QUERY_TOP_K);
+    struct RankedUser user = heap[i];
+    struct RankedUser last = heap[--*count];
+    if (i < *count) {
+        rank_place(table, group_id, rank, last);
+        rank_sift(table, group_id, rank);
+    }
+    return user;
+}
+
+/*
+ * Keeps the top heap full and every score in it at least the best of the
+ * rest. One score changes at a time, so at most one user crosses over.
+ */
+static void rank_balance(struct ViolationTable *table, int group_id) {
+    struct GroupRanking *list = &table->ranking[group_id];
+    while (list->top_count < QUERY_TOP_K && list->rest_count > 0) {
+        rank_push(table, group_id, 1, rank_take(table, group_id, QUERY_TOP_K));
+    }
+    while (list->top_count > 0 && list->rest_count > 0 && list->rest[0].score > list->top[0].score) {
+        struct RankedUser best = list->rest[0], weakest = list->top[0];
+        rank_place(table, group_id, 0, best);
+        rank_sift(table, group_id, 0);
+        rank_place(table, group_id, QUERY_TOP_K, weakest);
+        rank_sift(table, group_id, QUERY_TOP_K);
+    }
+}
+
+/* Adds a new entry to its group's ranking; rank_user() then places it by score. */
+static void rank_append(struct ViolationTable *table, struct UserViolations *entry) {
+    struct RankedUser user = {.user_id = entry->user_id, .score = entry->violations};
+    struct GroupRanking *list = &table->ranking[entry->group_id];
+    rank_push(table, entry->group_id, list->top_count < QUERY_TOP_K, user);
+}
+
+/*
+ * Re-sorts an entry whose score changed: O(log QUERY_TOP_K) in the top
+ * heap, O(log n) at worst in the rest. The group's published top is
+ * refreshed when the entry was or now is in it.
+ */
+static void rank_user(struct ViolationTable *table, struct UserViolations *entry) {
+    struct GroupRanking *list = &table->ranking[entry->group_id];
+    int group_id = entry->group_id, from = entry->rank;
+    if (from < QUERY_TOP_K) {
+        list->top[from].score = entry->violations;
+    } else {
+        list->rest[from - QUERY_TOP_K].score = entry->violations;
+    }
+    rank_sift(table, group_id, from);
+    rank_balance(table, group_id);
+    if (from < QUERY_TOP_K || entry->rank < QUERY_TOP_K) {
+        publish_top(table, group_id);
+    }
+}
+
+static void rank_remove(struct ViolationTable *table, const struct UserViolations *entry) {
+    int group_id = entry->group_id, from = entry->rank;
+    rank_take(table, group_id, from);
+    rank_balance(table, group_id);
+    if (from < QUERY_TOP_K) {
+        publish_top(table, group_id);
+    }
+}
+
+/* Backward-shift deletion, so no tombstones are left on the probe paths. */
+static void violation_table_remove(struct ViolationTable *table, unsigned int hole) {
+    if (is_ranked(table, table->slots[hole].group_id)) {
+        rank_remove(table, &table->slots[hole]);
+    }
+    unsigned int mask = table->capacity - 1;
+    for (unsigned int j = (hole + 1) & mask; table->slots[j].occupied; j = (j + 1) & mask) {
+        unsigned int home = violation_hash(table->slots[j].group_id, table->slots[j].user_id) & mask;
+        /* j may fill the hole unless its home lies between the hole and j. */
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            table->slots[hole] = table->slots[j];
+            hole = j;
+        }
+    }
+    table->slots[hole].occupied = 0;
+    table->count--;
+}
+
+/*
+ * Looks at the next SCORE_SWEEP slots and evicts expired users, then halves
+ * the table once it is mostly empty, so memory follows the active users.
+ */
+static void evict_idle_violations(struct ViolationTable *table) {
+    for (int k = 0; k < SCORE_SWEEP; k++) {
+        unsigned int i = table->sweep & (table->capacity - 1);
+        if (table->slots[i].occupied && violations_expired(table, &table->slots[i])) {
+            /* A later entry may have shifted into i; look at it next time. */
+            violation_table_remove(table, i);
+        } else {
+            table->sweep = i + 1;
+        }
+    }
+    if (table->capacity > VIOLATION_TABLE_MIN && 8 * table->count < table->capacity) {
+        violation_table_resize(table, table->capacity / 2);
+    }
+}
+
+/*
+ * Scores new_violations at timestamp under the scoring policy and returns
+ * the user's score: the running total, the sum over the window, or the
+ * decayed value rounded down. A timestamp older than the user's last one
+ * counts as the last one. Users are only added once they have a violation.
+ */
+int update_violations(struct ViolationTable *table, int group_id, int user_id, int new_violations, int timestamp) {
+    struct UserViolations *entry = table->capacity ? violation_slot(table, group_id, user_id) : NULL;
+    if (entry == NULL || !entry->occupied) {
+        if (new_violations == 0) {
+            return 0;
+        }
+        /* Keep the load factor at or below 1/2 so probe sequences stay short. */
+        if (2 * (table->count + 1) > table->capacity) {
+            violation_table_resize(table, table->capacity ? table->capacity * 2 : VIOLATION_TABLE_MIN);
+            entry = violation_slot(table, group_id, user_id);
+        }
+        memset(entry, 0, sizeof(*entry));
+        entry->occupied = 1;
+        entry->group_id = group_id;
+        entry->user_id = user_id;
+        entry->last_timestamp = timestamp;
+        table->count++;
+        if (is_ranked(table, group_id)) {
+            rank_append(table, entry);
+        }
+    }
+    if (timestamp < entry->last_timestamp) {
+        timestamp = entry->last_timestamp;
+    }
+    if (scoring_policy == SCORE_WINDOW) {
+        /* Empty the buckets that slid out of the window since the last message. */
+        long long last = score_bucket(entry->last_timestamp), next = score_bucket(timestamp);
+        for (long long b = last + 1; b <= next && b <= last + SCORE_BUCKETS; b++) {
+            entry->violations -= entry->buckets[score_bucket_slot(b)];
+            entry->buckets[score_bucket_slot(b)] = 0;
+        }
+        entry->buckets[score_bucket_slot(next)] += new_violations;
+        entry->violations += new_violations;
+    } else if (scoring_policy == SCORE_DECAY) {
+        long long elapsed = (long long)timestamp - entry->last_timestamp;
+        entry->decayed = entry->decayed * decay_factor((double)elapsed / scoring_span) +
+                         new_violations;
+        entry->violations = (int)entry->decayed;
+    } else {
+        entry->violations += new_violations;
+    }
+    entry->last_timestamp = timestamp;
+    advance_group_clock(table, group_id, timestamp);
+    int score = entry->violations;
+    if (is_ranked(table, group_id)) {
+        rank_user(table, entry);
+    }
+    if (scoring_policy != SCORE_TOTAL) {
+        evict_idle_violations(table);
+    }
+    return score;
+}
+
+/*
+ * Puts a persisted user into the table as it is. An entry kept under
+ * another policy or span starts over as one violation burst of its score
+ * at its last timestamp.
+ */
+void insert_violations(struct ViolationTable *table, const struct StateSnapshotEntry *saved, int policy, int span) {
+    if (2 * (table->count + 1) > table->capacity) {
+        violation_table_resize(table, table->capacity ? table->capacity * 2 : VIOLATION_TABLE_MIN);
+    }
+    struct UserViolations *entry = violation_slot(table, saved->group_id, saved->user_id);
+    int added = !entry->occupied, rank = entry->rank;
+    if (added) {
+        table->count++;
+    }
+    memset(entry, 0, sizeof(*entry));
+    entry->rank = rank;
+    entry->occupied = 1;
+    entry->group_id = saved->group_id;
+    entry->user_id = saved->user_id;
+    entry->violations = saved->violations;
+    entry->last_timestamp = saved->last_timestamp;
+    if (policy == scoring_policy && span == scoring_span) {
+        entry->decayed = saved->decayed;
+        memcpy(entry->buckets, saved->buckets, sizeof(entry->buckets));
+    } else {
+        entry->decayed = saved->violations;
+        if (scoring_policy == SCORE_WINDOW) {
+            entry->buckets[score_bucket_slot(score_bucket(saved->last_timestamp))] = saved->violations;
+        }
+    }
+    advance_group_clock(table, entry->group_id, entry->last_timestamp);
+    if (is_ranked(table, entry->group_id)) {
+        if (added) {
+            rank_append(table, entry);
+        }
+        rank_user(table, entry);
+    }
+}
+
+/*
+ * Which of count moderator instances owns (group, user): jump consistent
+ * hashing (Lamping and Veach) of the pair, so going from n to n + 1
+ * instances only moves the users that now belong to the new one. Must
+ * match groups.c.
+ */
+int instance_of(int group_id, int user_id, int count) {
+    unsigned long long key = ((unsigned long long)(unsigned int)group_id << 32) | (unsigned int)user_id;
+    long long bucket = -1, next = 0;
+    while (next < count) {
+        bucket = next;
+        key = key * 2862933555777941757ULL + 1;
+        next = (long long)((bucket + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+    }
+    return (int)bucket;
+}
+
+static long futex(unsigned int *addr, int op, unsigned int val) {
+    return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+void attach_bus(int key) {
+    int shmid = shmget(key, sizeof(struct BusRing), 0666);
+    if (shmid == -1) {
+        fprintf(stderr, "Error connecting to shared message bus (key: %d): %s\n", key, strerror(errno));
+        exit(1);
+    }
+    bus = shmat(shmid, NULL, 0);
+    if (bus == (void *)-1) {
+        fprintf(stderr, "Error attaching shared message bus: %s\n", strerror(errno));
+        exit(1);
+    }
+    printf("Successfully attached to shared message bus (id: %d)\n", shmid);
+}
+
+/* Takes the next published message off the ring, sleeping while it is empty. */
+void bus_receive(Message *msg) {
+    unsigned int pos = bus->head;
+    struct BusSlot *slot = &bus->slots[pos % BUS_RING_SLOTS];
+    while (1) {
+        unsigned int seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos + 1) {
+            break;
+        }
+        __atomic_store_n(&bus->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == seq) {
+            futex(&slot->seq, FUTEX_WAIT, seq);
+        }
+        __atomic_store_n(&bus->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+    }
+    *msg = slot->msg;
+    __atomic_store_n(&bus->head, pos + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&bus->producers_waiting, __ATOMIC_SEQ_CST)) {
+        futex(&bus->head, FUTEX_WAKE, 0x7fffffff);
+    }
+}
+
+static long long stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Within one moderator every counter has a single writer: a relaxed load
+ * and store, no locked instruction. Several moderator instances share the
+ * per-group slots, so they add atomically.
+ */
+static void stat_add(unsigned long long *counter, unsigned long long value) {
+    if (instance_count > 1) {
+        __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static int stats_bucket(unsigned long long ns) {
+    if (ns < 8) {
+        return ns;
+    }
+    int e = 63 - __builtin_clzll(ns);
+    int bucket = (e - 2) * 8 + (int)((ns >> (e - 3)) & 7);
+    return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+static void stats_record(struct LatencyHistogram *h, long long ns) {
+    if (ns < 0) {
+        ns = 0;
+    }
+    stat_add(&h->count, 1);
+    stat_add(&h->sum_ns, ns);
+    stat_add(&h->buckets[stats_bucket(ns)], 1);
+    if ((unsigned long long)ns > __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&h->max_ns, ns, __ATOMIC_RELAXED);
+    }
+}
+
+/* Maps /chat-stats-<test_case>, creating it if needed; NULL disables stats. */
+static struct StatsSegment *attach_stats(int test_case) {
+    const char *setting = getenv("CHAT_STATS");
+    if (setting != NULL && strcmp(setting, "off") == 0) {
+        return NULL;
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "/chat-stats-%d", test_case);
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0666);
+    if (fd == -1) {
+        fprintf(stderr, "Stats disabled: cannot open %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (st.st_size < (off_t)sizeof(struct StatsSegment) &&
+                                 ftruncate(fd, sizeof(struct StatsSegment)) == -1)) {
+        fprintf(stderr, "Stats disabled: cannot size %s: %s\n", name, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    struct StatsSegment *segment = mmap(NULL, sizeof(struct StatsSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        fprintf(stderr, "Stats disabled: cannot map %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+    /* Every writer stores the same values, so racing first attaches are harmless. */
+    __atomic_store_n(&segment->version, STATS_VERSION, __ATOMIC_RELAXED);
+    __atomic_store_n(&segment->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+    return segment;
+}
+
+/* Samples queue and ring depths for stats.out, off the message path. */
+void *stats_sampler(void *arg) {
+    (void)arg;
+    int validation_queue_id = -1;
+    while (1) {
+        struct msqid_ds info;
+        if (msgctl(moderator_msgid, IPC_STAT, &info) == 0) {
+            __atomic_store_n(&stats->moderator_queue.messages, info.msg_qnum, __ATOMIC_RELAXED);
+            __atomic_store_n(&stats->moderator_queue.bytes, info.__msg_cbytes, __ATOMIC_RELAXED);
+            if (info.msg_qnum > stats->moderator_queue.max_messages) {
+                __atomic_store_n(&stats->moderator_queue.max_messages, info.msg_qnum, __ATOMIC_RELAXED);
+            }
+        }
+        if (validation_queue_id == -1) {
+            validation_queue_id = msgget(stats_validation_queue_key, 0666);
+        }
+        if (validation_queue_id != -1 && msgctl(validation_queue_id, IPC_STAT, &info) == 0) {
+            __atomic_store_n(&stats->validation_queue.messages, info.msg_qnum, __ATOMIC_RELAXED);
+            __atomic_store_n(&stats->validation_queue.bytes, info.__msg_cbytes, __ATOMIC_RELAXED);
+            if (info.msg_qnum > stats->validation_queue.max_messages) {
+                __atomic_store_n(&stats->validation_queue.max_messages, info.msg_qnum, __ATOMIC_RELAXED);
+            }
+        } else {
+            validation_queue_id = -1;
+        }
+        if (msgctl(verdict_msgid, IPC_STAT, &info) == 0) {
+            __atomic_store_n(&stats->verdict_queue.messages, info.msg_qnum, __ATOMIC_RELAXED);
+            __atomic_store_n(&stats->verdict_queue.bytes, info.__msg_cbytes, __ATOMIC_RELAXED);
+            if (info.msg_qnum > stats->verdict_queue.max_messages) {
+                __atomic_store_n(&stats->verdict_queue.max_messages, info.msg_qnum, __ATOMIC_RELAXED);
+            }
+        }
+        if (bus != NULL) {
+            unsigned int depth = __atomic_load_n(&bus->tail, __ATOMIC_RELAXED) - __atomic_load_n(&bus->head, __ATOMIC_RELAXED);
+            __atomic_store_n(&stats->bus.messages, depth, __ATOMIC_RELAXED);
+            if (depth > stats->bus.max_messages) {
+                __atomic_store_n(&stats->bus.max_messages, depth, __ATOMIC_RELAXED);
+            }
+        }
+        __atomic_store_n(&stats->sampled_ns, stats_now_ns(), __ATOMIC_RELEASE);
+
+        struct timespec pause = {0, STATS_SAMPLE_MS * 1000000L};
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+void start_stats(int test_case, int validation_queue_key) {
+    stats = attach_stats(test_case);
+    /* The first instance owns the shared fields and samples its own queue. */
+    if (stats == NULL || instance_index > 0) {
+        return;
+    }
+    /*
+     * A lone moderator clears what an earlier run left. Several instances
+     * all add to moderator[], and app.out hands them a fresh segment, so
+     * none of them may clear it.
+     */
+    if (instance_count == 1) {
+        memset(&stats->moderator_queue, 0, sizeof(stats->moderator_queue));
+        memset(&stats->validation_queue, 0, sizeof(stats->validation_queue));
+        memset(&stats->bus, 0, sizeof(stats->bus));
+        memset(&stats->verdict_queue, 0, sizeof(stats->verdict_queue));
+        memset(stats->moderator, 0, sizeof(stats->moderator));
+    }
+    stats->moderator_pid = getpid();
+    __atomic_store_n(&stats->moderator_active, 1, __ATOMIC_RELEASE);
+    stats_validation_queue_key = validation_queue_key;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, stats_sampler, NULL) != 0) {
+        fprintf(stderr, "Error creating stats thread\n");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+static unsigned int state_record_check_v1(const struct StateLogRecordV1 *record) {
+    return STATE_LOG_MAGIC ^ (unsigned int)record->seq ^ (unsigned int)(record->seq >> 32) ^
+           violation_hash(record->group_id, record->user_id) ^ (unsigned int)record->delta;
+}
+
+static unsigned int state_record_check(const struct StateLogRecord *record) {
+    return STATE_LOG_MAGIC ^ (unsigned int)record->seq ^ (unsigned int)(record->seq >> 32) ^
+           violation_hash(record->group_id, record->user_id) ^ (unsigned int)record->delta ^
+           (unsigned int)record->timestamp * 0x9e3779b9u;
+}
+
+/* Buffers a delta in the shard's wal; the caller holds shard->state_lock. */
+void log_violations(struct Shard *shard, int group_id, int user_id, int delta, int timestamp) {
+    if (shard->wal_count == shard->wal_capacity) {
+        shard->wal_capacity = shard->wal_capacity ? shard->wal_capacity * 2 : 1024;
+        shard->wal = realloc(shard->wal, shard->wal_capacity * sizeof(struct StateLogRecord));
+        if (shard->wal == NULL) {
+            fprintf(stderr, "Out of memory buffering violation log\n");
+            exit(1);
+        }
+    }
+    struct StateLogRecord *record = &shard->wal[shard->wal_count++];
+    record->group_id = group_id;
+    record->user_id = user_id;
+    record->delta = delta;
+    record->timestamp = timestamp;
+    record->pad = 0;
+}
+
+/*
+ * violations.snap and violations.log for a single moderator instance,
+ * violations.<i>-of-<n>.snap and .log for instance i of n. Names never
+ * repeat across instance counts, so a rebalance never overwrites the files
+ * it is reading.
+ */
+static void state_file(char *path, size_t size, int instance, int count, const char *kind) {
+    if (count == 1) {
+        snprintf(path, size, "%s/violations.%s", state_dir, kind);
+    } else {
+        snprintf(path, size, "%s/violations.%d-of-%d.%s", state_dir, instance, count, kind);
+    }
+}
+
+static void sync_state_dir(void) {
+    int dir_fd = open(state_dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd != -1) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+}
+
+static void snapshot_entry(const struct UserViolations *slot, struct StateSnapshotEntry *entry) {
+    entry->group_id = slot->group_id;
+    entry->user_id = slot->user_id;
+    entry->violations = slot->violations;
+    entry->last_timestamp = slot->last_timestamp;
+    entry->decayed = slot->decayed;
+    memcpy(entry->buckets, slot->buckets, sizeof(entry->buckets));
+}
+
+/* Writes count entries as a snapshot to path through a synced temporary file and a rename. */
+static int write_snapshot_file(const char *path, const struct StateSnapshotEntry *entries, int count,
+                               unsigned long long last_seq) {
+    char tmp[512];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        fprintf(stderr, "Snapshot path too long: %s\n", path);
+        return -1;
+    }
+    FILE *file = fopen(tmp, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Error creating %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    struct StateSnapshotHeader header = {
+        .magic = STATE_SNAPSHOT_MAGIC,
+        .version = STATE_SNAPSHOT_VERSION,
+        .last_seq = last_seq,
+        .count = count,
+        .policy = scoring_policy,
+        .span = scoring_span,
+    };
+    if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+        fwrite(entries, sizeof(*entries), count, file) != (size_t)count || fflush(file) != 0 || fsync(fileno(file)) == -1) {
+        fprintf(stderr, "Error writing %s: %s\n", tmp, strerror(errno));
+        fclose(file);
+        unlink(tmp);
+        return -1;
+    }
+    fclose(file);
+    if (rename(tmp, path) == -1) {
+        fprintf(stderr, "Error renaming %s: %s\n", tmp, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    sync_state_dir();
+    return 0;
+}
+
+/* Appends the entries of table's occupied slots to entries; returns the new count. */
+static int collect_entries(const struct ViolationTable *table, struct StateSnapshotEntry *entries, int count) {
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->slots[i].occupied) {
+            snapshot_entry(&table->slots[i], &entries[count++]);
+        }
+    }
+    return count;
+}
+
+/* Writes entries as this instance's snapshot (via rename) and empties the log. */
+static void write_state_snapshot(const struct StateSnapshotEntry *entries, int count) {
+    char path[512];
+    state_file(path, sizeof(path), instance_index, instance_count, "snap");
+    if (write_snapshot_file(path, entries, count, state_last_seq) == -1) {
+        return;
+    }
+    /* Everything in the log is now in the snapshot. */
+    if (ftruncate(state_log_fd, 0) == -1) {
+        fprintf(stderr, "Error truncating violation log: %s\n", strerror(errno));
+    }
+    state_since_snapshot = 0;
+    state_needs_snapshot = 0;
+    printf("Wrote violation snapshot: %d users up to record %llu\n", count, state_last_seq);
+}
+
+static void append_state_log(struct StateLogRecord *records, int count) {
+    for (int i = 0; i < count; i++) {
+        records[i].seq = ++state_last_seq;
+        records[i].check = state_record_check(&records[i]);
+    }
+    const char *p = (const char *)records;
+    size_t left = (size_t)count * sizeof(struct StateLogRecord);
+    while (left > 0) {
+        ssize_t written = write(state_log_fd, p, left);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error writing violation log: %s\n", strerror(errno));
+            exit(1);
+        }
+        p += written;
+        left -= written;
+    }
+}
+
+/*
+ * Group commit: appends everything the shards buffered since the last
+ * commit and makes it durable with one fdatasync. Called every
+ * STATE_COMMIT_MS by the writer thread and once more on shutdown.
+ *
+ * Every STATE_SNAPSHOT_RECORDS records (or when recovery asks for it) the
+ * commit also snapshots the shards' own tables. Each shard is then held
+ * just long enough to take its wal and copy its entries, all at once, so
+ * the copy holds exactly the records up to this batch's last seq. The
+ * files are written after the shards are released.
+ */
+void commit_state(void) {
+    pthread_mutex_lock(&state_commit_lock);
+    int snapshot = state_needs_snapshot || state_since_snapshot >= STATE_SNAPSHOT_RECORDS;
+    struct StateSnapshotEntry *entries = NULL;
+    int entry_count = 0;
+    if (snapshot) {
+        int total = 0;
+        for (int i = 0; i < worker_count; i++) {
+            pthread_mutex_lock(&shards[i].state_lock);
+            total += shards[i].violations.count;
+        }
+        entries = xrealloc(NULL, (size_t)(total ? total : 1) * sizeof(*entries));
+    }
+    /* Swap buffers so each worker keeps appending while its batch is written. */
+    for (int i = 0; i < worker_count; i++) {
+        struct Shard *shard = &shards[i];
+        if (!snapshot) {
+            pthread_mutex_lock(&shard->state_lock);
+        }
+        struct StateLogRecord *records = shard->wal;
+        int records_capacity = shard->wal_capacity;
+        int count = shard->wal_count;
+        shard->wal = shard->wal_spare;
+        shard->wal_capacity = shard->wal_spare_capacity;
+        shard->wal_count = 0;
+        if (snapshot) {
+            entry_count = collect_entries(&shard->violations, entries, entry_count);
+        }
+        pthread_mutex_unlock(&shard->state_lock);
+        shard->wal_spare = records;
+        shard->wal_spare_capacity = records_capacity;
+        shard->wal_spare_count = count;
+    }
+
+    int count = 0;
+    for (int i = 0; i < worker_count; i++) {
+        append_state_log(shards[i].wal_spare, shards[i].wal_spare_count);
+        count += shards[i].wal_spare_count;
+    }
+    if (count > 0 && fdatasync(state_log_fd) == -1) {
+        fprintf(stderr, "Error syncing violation log: %s\n", strerror(errno));
+        exit(1);
+    }
+    state_since_snapshot += count;
+    if (snapshot) {
+        write_state_snapshot(entries, entry_count);
+        free(entries);
+    }
+    pthread_mutex_unlock(&state_commit_lock);
+}
+
+void *state_writer(void *arg) {
+    (void)arg;
+    while (1) {
+        struct timespec pause = {0, STATE_COMMIT_MS * 1000000L};
+        nanosleep(&pause, NULL);
+        commit_state();
+    }
+    return NULL;
+}
 
-struct FilteredWord filtered_words[MAX_FILTERED_WORDS];
-int filtered_word_count = 0;
-struct UserViolations user_violations[MAX_USERS * MAX_GROUPS];
-int user_violations_count = 0;
-int threshold_violations;
+static void restore_violations(int group_id, int user_id, int delta, int timestamp) {
+    struct Shard *shard = &shards[(unsigned int)group_id % worker_count];
+    update_violations(&shard->violations, group_id, user_id, delta, timestamp);
+}
 
-void load_filtered_words(const char* testcase_folder) {
-    char filename[256];
-    snprintf(filename, sizeof(filename), "%s/filtered_words.txt", testcase_folder);
-    FILE* file = fopen(filename, "r");
+static void restore_entry(const struct StateSnapshotEntry *entry, int policy, int span) {
+    struct Shard *shard = &shards[(unsigned int)entry->group_id % worker_count];
+    insert_violations(&shard->violations, entry, policy, span);
+}
+
+/*
+ * Applies every entry of a snapshot (mapped); returns how many there were,
+ * 0 if there is none. Version 1 snapshots and snapshots kept under another
+ * scoring policy are converted and flag state_needs_snapshot.
+ */
+static int load_state_snapshot(const char *path, void (*apply)(const struct StateSnapshotEntry *, int, int),
+                               unsigned long long *last_seq) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    struct stat st;
+    void *image = MAP_FAILED;
+    size_t v1_header = offsetof(struct StateSnapshotHeader, span);
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)v1_header) {
+        image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    const struct StateSnapshotHeader *header = image;
+    int v1 = image != MAP_FAILED && header->version == 1;
+    size_t header_size = v1 ? v1_header : sizeof(*header);
+    size_t entry_size = v1 ? sizeof(struct StateSnapshotEntryV1) : sizeof(struct StateSnapshotEntry);
+    if (image == MAP_FAILED || header->magic != STATE_SNAPSHOT_MAGIC ||
+        (!v1 && header->version != STATE_SNAPSHOT_VERSION) || header->count < 0 ||
+        (size_t)st.st_size != header_size + (size_t)header->count * entry_size) {
+        fprintf(stderr, "Error: %s is not a valid violation snapshot\n", path);
+        exit(1);
+    }
+    int policy = v1 ? SCORE_TOTAL : header->policy, span = v1 ? 0 : header->span;
+    const char *entries = (const char *)image + header_size;
+    for (int i = 0; i < header->count; i++) {
+        struct StateSnapshotEntry entry;
+        if (v1) {
+            const struct StateSnapshotEntryV1 *old = (const void *)(entries + i * entry_size);
+            entry = (struct StateSnapshotEntry){old->group_id, old->user_id, old->violations, 0, 0, {0}};
+        } else {
+            memcpy(&entry, entries + i * entry_size, sizeof(entry));
+        }
+        apply(&entry, policy, span);
+    }
+    if (policy != scoring_policy || span != scoring_span) {
+        state_needs_snapshot = 1;
+    }
+    int count = header->count;
+    *last_seq = header->last_seq;
+    munmap(image, st.st_size);
+    return count;
+}
+
+/*
+ * Applies the log records after *last_seq and returns the length of the
+ * valid prefix; a torn or out-of-sequence record ends it. A version 1 log
+ * (recognised by its first record) is replayed with every timestamp 0 and
+ * flags state_needs_snapshot, so it is compacted before anything is
+ * appended in the new format.
+ */
+static off_t replay_state_log(int fd, const char *path, void (*apply)(int, int, int, int),
+                              unsigned long long *last_seq, int *replayed) {
+    struct StateLogRecordV1 old;
+    int v1 = pread(fd, &old, sizeof(old), 0) == sizeof(old) && old.check == state_record_check_v1(&old);
+    FILE *log = fdopen(dup(fd), "rb");
+    if (log == NULL) {
+        fprintf(stderr, "Error reading %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    struct StateLogRecord record;
+    off_t valid_end = 0;
+    while (1) {
+        if (v1) {
+            if (fread(&old, sizeof(old), 1, log) != 1 || old.check != state_record_check_v1(&old)) {
+                break;
+            }
+            record = (struct StateLogRecord){old.seq, old.group_id, old.user_id, old.delta, 0, 0, 0};
+        } else if (fread(&record, sizeof(record), 1, log) != 1 || record.check != state_record_check(&record)) {
+            break;
+        }
+        if (record.seq > *last_seq) {
+            if (record.seq != *last_seq + 1) {
+                break;
+            }
+            apply(record.group_id, record.user_id, record.delta, record.timestamp);
+            *last_seq = record.seq;
+            (*replayed)++;
+        }
+        valid_end += v1 ? sizeof(old) : sizeof(record);
+    }
+    fclose(log);
+    if (v1) {
+        state_needs_snapshot = 1;
+    }
+    return valid_end;
+}
+
+/* How many instances wrote the state in state_dir; 1 when it predates instances. */
+static int read_instance_count(void) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/instances", state_dir);
+    FILE *file = fopen(path, "r");
     if (file == NULL) {
-        fprintf(stderr, "Error opening %s: %s\n", filename, strerror(errno));
+        return 1;
+    }
+    int count;
+    if (fscanf(file, "%d", &count) != 1 || count < 1 || count > MAX_MODERATORS) {
+        fprintf(stderr, "Error: %s is not a valid instance count\n", path);
         exit(1);
     }
+    fclose(file);
+    return count;
+}
+
+struct ViolationTable rebalance_totals;
+
+static void rebalance_add(int group_id, int user_id, int delta, int timestamp) {
+    update_violations(&rebalance_totals, group_id, user_id, delta, timestamp);
+}
+
+static void rebalance_entry(const struct StateSnapshotEntry *entry, int policy, int span) {
+    insert_violations(&rebalance_totals, entry, policy, span);
+}
+
+/*
+ * Hands persisted totals over to a new number of instances: merges every
+ * old instance's snapshot and log, splits the totals by instance_of() and
+ * writes each new instance a snapshot and no log. Rewriting the instances
+ * file is the commit point; until then the old files are untouched, so an
+ * interrupted rebalance just runs again. Every total ends up in exactly one
+ * new snapshot, never reset and never counted twice. Runs while no
+ * moderator is attached to state_dir.
+ */
+int rebalance_state(int count) {
+    int old_count = read_instance_count();
+    if (old_count == count) {
+        return 0;
+    }
+    char path[512], tmp[sizeof(path) + sizeof(".tmp")];
+    for (int i = 0; i < old_count; i++) {
+        unsigned long long last_seq = 0;
+        int replayed = 0;
+        state_file(path, sizeof(path), i, old_count, "snap");
+        load_state_snapshot(path, rebalance_entry, &last_seq);
+        state_file(path, sizeof(path), i, old_count, "log");
+        int fd = open(path, O_RDONLY);
+        if (fd != -1) {
+            replay_state_log(fd, path, rebalance_add, &last_seq, &replayed);
+            close(fd);
+        }
+    }
 
-    while (filtered_word_count < MAX_FILTERED_WORDS &&
-           fscanf(file, "%19s", filtered_words[filtered_word_count].word) == 1) {
-        filtered_word_count++;
+    struct StateSnapshotEntry *parts[MAX_MODERATORS];
+    int part_counts[MAX_MODERATORS] = {0};
+    size_t part_size = (size_t)(rebalance_totals.count ? rebalance_totals.count : 1) * sizeof(struct StateSnapshotEntry);
+    for (int i = 0; i < count; i++) {
+        parts[i] = xrealloc(NULL, part_size);
+    }
+    for (int i = 0; i < rebalance_totals.capacity; i++) {
+        const struct UserViolations *slot = &rebalance_totals.slots[i];
+        if (slot->occupied) {
+            int part = instance_of(slot->group_id, slot->user_id, count);
+            snapshot_entry(slot, &parts[part][part_counts[part]++]);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        state_file(path, sizeof(path), i, count, "snap");
+        if (write_snapshot_file(path, parts[i], part_counts[i], 0) == -1) {
+            return -1;
+        }
+        state_file(path, sizeof(path), i, count, "log");
+        if (unlink(path) == -1 && errno != ENOENT) {
+            fprintf(stderr, "Error removing %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        free(parts[i]);
     }
 
+    snprintf(path, sizeof(path), "%s/instances", state_dir);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *file = fopen(tmp, "w");
+    if (file == NULL || fprintf(file, "%d\n", count) < 0 || fflush(file) != 0 || fsync(fileno(file)) == -1) {
+        fprintf(stderr, "Error writing %s: %s\n", tmp, strerror(errno));
+        if (file != NULL) {
+            fclose(file);
+        }
+        return -1;
+    }
     fclose(file);
+    if (rename(tmp, path) == -1) {
+        fprintf(stderr, "Error renaming %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    sync_state_dir();
+
+    for (int i = 0; i < old_count; i++) {
+        state_file(path, sizeof(path), i, old_count, "snap");
+        unlink(path);
+        state_file(path, sizeof(path), i, old_count, "log");
+        unlink(path);
+    }
+    printf("Rebalanced violation state: %d users from %d to %d instance(s)\n",
+           rebalance_totals.count, old_count, count);
+    free(rebalance_totals.slots);
+    memset(&rebalance_totals, 0, sizeof(rebalance_totals));
+    return 0;
+}
+
+/*
+ * Rebuilds the shards' totals from this instance's snapshot (mapped) plus
+ * the log records after it, drops a torn record at the end of the log, and
+ * starts the writer. Runs before any message is read. A lone moderator
+ * takes over state left by several instances itself; with several, app.c
+ * rebalances before starting them.
+ */
+void start_state_persistence(void) {
+    char path[512];
+    int restored, replayed = 0;
+
+    if (read_instance_count() != instance_count) {
+        if (instance_count > 1) {
+            fprintf(stderr, "Error: %s holds state for %d moderator instance(s), not %d; rebalance it first\n",
+                    state_dir, read_instance_count(), instance_count);
+            exit(1);
+        }
+        if (rebalance_state(1) == -1) {
+            exit(1);
+        }
+    }
+
+    state_needs_snapshot = 0;
+    state_file(path, sizeof(path), instance_index, instance_count, "snap");
+    restored = load_state_snapshot(path, restore_entry, &state_last_seq);
+
+    state_file(path, sizeof(path), instance_index, instance_count, "log");
+    /* O_APPEND so writes land at the new end after a snapshot truncates the log. */
+    state_log_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (state_log_fd == -1) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    off_t valid_end = replay_state_log(state_log_fd, path, restore_violations, &state_last_seq, &replayed);
+    if (ftruncate(state_log_fd, valid_end) == -1) {
+        fprintf(stderr, "Error truncating %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    printf("Recovered violation state: %d users from snapshot, %d log records\n", restored, replayed);
+    if (state_needs_snapshot) {
+        commit_state();
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, state_writer, NULL) != 0) {
+        fprintf(stderr, "Error creating state writer thread\n");
+        exit(1);
+    }
+    pthread_detach(thread);
 }
 
-void to_lower(char* str) {
-    for (int i = 0; str[i]; i++) {
-        str[i] = tolower((unsigned char)str[i]);
+/* Sends a verdict to the group's listeners; they always drain the verdict queue. */
+void send_verdict(Message *msg) {
+    msg->mtype = VERDICT_MTYPE_BASE + msg->modifyingGroup;
+    if (msgsnd(verdict_msgid, msg, sizeof(Message) - sizeof(long), 0) == -1) {
+        fprintf(stderr, "Error in msgsnd: %s\n", strerror(errno));
+        exit(1);
     }
 }
 
-int count_violations(const char* message) {
-    char lower_message[MAX_MESSAGE_LENGTH];
-    strncpy(lower_message, message, MAX_MESSAGE_LENGTH - 1);
-    lower_message[MAX_MESSAGE_LENGTH - 1] = '\0';
-    to_lower(lower_message);
+void process_message(struct Shard *shard, Message *msg, long long received_ns) {
+    /* Runs on the group's shard, so every earlier verdict for the group has been sent. */
+    if (msg->user == VERDICT_CLOSE_USER) {
+        send_verdict(msg);
+        return;
+    }
+    log_event(LOG_DEBUG, "Received message from group %d, user %d: %s\n", msg->mtext,
+    msg->modifyingGroup, msg->user);
+
+    /* Announce the epoch before loading the pointer; see reload_filter(). */
+    unsigned long epoch = __atomic_load_n(&matcher_epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&shard->reader_epoch, epoch, __ATOMIC_SEQ_CST);
+    const struct Matcher *m = __atomic_load_n(&active_matcher, __ATOMIC_SEQ_CST);
+    int duplicate;
+    int violations = cached_violations(shard, m, epoch, msg->mtext, &duplicate);
+    __atomic_store_n(&shard->reader_epoch, 0, __ATOMIC_RELEASE);
+    if (state_enabled) {
+        pthread_mutex_lock(&shard->state_lock);
+    }
+    int total_violations = update_violations(&shard->violations, msg->modifyingGroup, msg->user, violations,
+                                             msg->timestamp);
+    if (state_enabled) {
+        if (violations > 0) {
+            log_violations(shard, msg->modifyingGroup, msg->user, violations, msg->timestamp);
+        }
+        pthread_mutex_unlock(&shard->state_lock);
+    }
+
+    log_event(LOG_DEBUG, "User %d from group %d has %d violations\n", NULL,
+    msg->user, msg->modifyingGroup, total_violations);
 
-    int violations = 0;
-    for (int i = 0; i < filtered_word_count; i++) {
-        char lower_word[MAX_WORD_LENGTH];
-        strncpy(lower_word, filtered_words[i].word, MAX_WORD_LENGTH - 1);
-        lower_word[MAX_WORD_LENGTH - 1] = '\0';
-        to_lower(lower_word);
+    struct GroupActivity *activity = &group_activity[msg->modifyingGroup];
+    stat_add(&activity->messages, 1);
+    stat_add(&activity->violations, violations);
 
-        if (strstr(lower_message, lower_word) != NULL) {
-            violations++;
+    struct ModeratorGroupStats *group_stats = NULL;
+    if (stats) {
+        group_stats = &stats->moderator[msg->modifyingGroup];
+        stat_add(&group_stats->violations, violations);
+        if (duplicate) {
+            stat_add(&group_stats->duplicates, 1);
         }
     }
 
-    return violations;
+    if (total_violations >= threshold_violations) {
+        log_event(LOG_INFO, "User %d from group %d has been removed due to %d violations.\n", NULL,
+        msg->user, msg->modifyingGroup, total_violations);
+
+        /* Send time for the group's verdict -> removal histogram; see groups.c. */
+        msg->timestamp = (int)(unsigned int)(stats_now_ns() / 1000);
+        send_verdict(msg);
+        stat_add(&activity->removals, 1);
+        if (group_stats) {
+            stat_add(&group_stats->removals, 1);
+        }
+    }
+    if (group_stats) {
+        stats_record(&group_stats->receive_to_verdict, stats_now_ns() - received_ns);
+    }
+}
+
+void *shard_worker(void *arg) {
+    struct Shard *shard = arg;
+    Message msg;
+    while (1) {
+        pthread_mutex_lock(&shard->lock);
+        while (shard->count == 0) {
+            pthread_cond_wait(&shard->not_empty, &shard->lock);
+        }
+        msg = shard->ring[shard->head];
+        long long received_ns = shard->received_ns[shard->head];
+        shard->head = (shard->head + 1) % SHARD_QUEUE_SIZE;
+        shard->count--;
+        shard->busy = 1;
+        pthread_cond_signal(&shard->not_full);
+        pthread_mutex_unlock(&shard->lock);
+
+        process_message(shard, &msg, received_ns);
+
+        pthread_mutex_lock(&shard->lock);
+        shard->busy = 0;
+        pthread_cond_signal(&shard->not_full);
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return NULL;
 }
 
-void update_violations(int group_id, int user_id, int new_violations) {
-    // Prevent array overflow
-    if (user_violations_count >= MAX_USERS * MAX_GROUPS) {
-        fprintf(stderr, "User violations storage full!\n");
+void dispatch_message(const Message *msg, long long received_ns) {
+    struct Shard *shard = &shards[(unsigned int)msg->modifyingGroup % worker_count];
+    pthread_mutex_lock(&shard->lock);
+    while (shard->count == SHARD_QUEUE_SIZE) {
+        pthread_cond_wait(&shard->not_full, &shard->lock);
+    }
+    shard->ring[(shard->head + shard->count) % SHARD_QUEUE_SIZE] = *msg;
+    shard->received_ns[(shard->head + shard->count) % SHARD_QUEUE_SIZE] = received_ns;
+    shard->count++;
+    pthread_cond_signal(&shard->not_empty);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void handle_incoming(Message *msg, long long received_ns) {
+    if (msg->timestamp > MAX_TIMESTAMP) {
+        fprintf(stderr, "Error: Timestamp exceeds maximum allowed value\n");
+        return;
+    }
+    if (msg->modifyingGroup < 0 || msg->modifyingGroup >= MAX_GROUPS) {
+        fprintf(stderr, "Error: Message from unknown group %d\n", msg->modifyingGroup);
         return;
     }
-    for (int i = 0; i < user_violations_count; i++) {
-        if (user_violations[i].group_id == group_id && user_violations[i].user_id == user_id) {
-            user_violations[i].violations += new_violations;
+    if (stats && msg->user != VERDICT_CLOSE_USER) {
+        stat_add(&stats->moderator[msg->modifyingGroup].received, 1);
+    }
+
+    if (worker_count > 1) {
+        dispatch_message(msg, received_ns);
+    } else {
+        process_message(&shards[0], msg, received_ns);
+    }
+}
+
+void unpack_batch(const struct BatchFrame *batch, ssize_t size, long long received_ns) {
+    const char *p = batch->data;
+    const char *end = (const char *)batch + sizeof(long) + size;
+    Message msg;
+    msg.modifyingGroup = batch->group;
+    msg.mtype = MAX_GROUPS + batch->group;
+    for (int i = 0; i < batch->count; i++) {
+        struct BatchRecordHeader header;
+        if (end - p < (ssize_t)sizeof(header)) {
+            fprintf(stderr, "Truncated batch from group %d\n", batch->group);
+            return;
+        }
+        memcpy(&header, p, sizeof(header));
+        p += sizeof(header);
+        if (header.len >= sizeof(msg.mtext) || end - p < header.len) {
+            fprintf(stderr, "Malformed batch record from group %d\n", batch->group);
             return;
         }
+        msg.timestamp = header.timestamp;
+        msg.user = header.user;
+        memcpy(msg.mtext, p, header.len);
+        msg.mtext[header.len] = '\0';
+        p += header.len;
+        handle_incoming(&msg, received_ns);
+    }
+}
+
+/* Waits until every worker has processed everything dispatched to it. */
+void drain_workers(void) {
+    if (worker_count == 1) {
+        return;
+    }
+    for (int i = 0; i < worker_count; i++) {
+        struct Shard *shard = &shards[i];
+        pthread_mutex_lock(&shard->lock);
+        while (shard->count > 0 || shard->busy) {
+            pthread_cond_wait(&shard->not_full, &shard->lock);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/*
+ * app.c sends MODERATOR_STOP_MTYPE to the instances it started once every
+ * group has finished; queues and the bus are FIFO, so everything the
+ * groups sent has been read by then.
+ */
+void stop_moderator(void) {
+    drain_workers();
+    if (state_enabled) {
+        commit_state();
+    }
+    log_flush();
+    unsigned long long lookups = 0, hits = 0;
+    for (int i = 0; i < worker_count; i++) {
+        lookups += shards[i].cache.lookups;
+        hits += shards[i].cache.hits;
+    }
+    if (lookups > 0) {
+        printf("Count cache: %llu of %llu messages were duplicates (%.1f%%)\n", hits, lookups, 100.0 * hits / lookups);
+    }
+    printf("Moderator instance %d of %d stopping\n", instance_index, instance_count);
+    exit(0);
+}
+
+/*
+ * Offers the batched format to a group still sending plain messages, once
+ * per run of the group: the offer waits in the verdict queue until the
+ * group's listener takes it. A full queue just moves the offer to the
+ * group's next plain message.
+ */
+void acknowledge_batching(int group) {
+    if (group < 0 || group >= MAX_GROUPS || batching_offered[group]) {
+        return;
+    }
+    Message ack = {.mtype = VERDICT_MTYPE_BASE + group, .user = BATCH_ACK_USER, .modifyingGroup = group};
+    if (msgsnd(verdict_msgid, &ack, sizeof(Message) - sizeof(long), IPC_NOWAIT) == 0) {
+        batching_offered[group] = 1;
+    } else if (errno != EAGAIN) {
+        fprintf(stderr, "Error offering batched format to group %d: %s\n", group, strerror(errno));
+    }
+}
+
+void start_workers(void) {
+    shards = calloc(worker_count, sizeof(struct Shard));
+    if (shards == NULL) {
+        fprintf(stderr, "Out of memory allocating shards\n");
+        exit(1);
+    }
+    /* MODERATOR_CACHE=off scans every message, duplicates included. */
+    const char *cache = getenv("MODERATOR_CACHE");
+    int cache_enabled = cache == NULL || strcmp(cache, "off") != 0;
+    count_cache_seed = (unsigned long long)stats_now_ns() * 0x9e3779b97f4a7c15ULL ^ (unsigned long long)getpid() << 32;
+    for (int i = 0; i < worker_count; i++) {
+        shards[i].index = i;
+        shards[i].violations.ranked = 1;
+        if (cache_enabled) {
+            shards[i].cache.buckets = aligned_alloc(64, COUNT_CACHE_BUCKETS * sizeof(struct CountCacheBucket));
+            shards[i].cache.texts = malloc((size_t)COUNT_CACHE_BUCKETS * COUNT_CACHE_WAYS * MAX_MESSAGE_LENGTH);
+            if (shards[i].cache.buckets == NULL || shards[i].cache.texts == NULL) {
+                fprintf(stderr, "Out of memory allocating count cache\n");
+                exit(1);
+            }
+        }
+        pthread_mutex_init(&shards[i].lock, NULL);
+        pthread_mutex_init(&shards[i].state_lock, NULL);
+        pthread_cond_init(&shards[i].not_empty, NULL);
+        pthread_cond_init(&shards[i].not_full, NULL);
+        if (worker_count > 1 && pthread_create(&shards[i].thread, NULL, shard_worker, &shards[i]) != 0) {
+            fprintf(stderr, "Error creating worker thread %d\n", i);
+            exit(1);
+        }
+    }
+    printf("Moderating with %d worker thread(s)\n", worker_count);
+    if (cache_enabled) {
+        printf("Caching violation counts for %d texts per worker\n", COUNT_CACHE_BUCKETS * COUNT_CACHE_WAYS);
+    }
+}
+
+/*
+ * Swaps in a freshly loaded filter without stopping the workers. Shards
+ * announce the epoch they read active_matcher under; once every shard is
+ * idle or has announced an epoch after the swap, nothing can still be
+ * using the old matcher and it is freed. Violation counts are untouched.
+ */
+void reload_filter(void) {
+    struct Matcher *next = load_filter(filter_folder, 0);
+    if (next == NULL) {
+        fprintf(stderr, "Filter reload failed; keeping the current word list\n");
+        return;
+    }
+    struct Matcher *old = __atomic_exchange_n(&active_matcher, next, __ATOMIC_SEQ_CST);
+    unsigned long epoch = __atomic_add_fetch(&matcher_epoch, 1, __ATOMIC_SEQ_CST);
+
+    for (int i = 0; i < worker_count; i++) {
+        while (1) {
+            unsigned long seen = __atomic_load_n(&shards[i].reader_epoch, __ATOMIC_SEQ_CST);
+            if (seen == 0 || seen >= epoch) {
+                break;
+            }
+            struct timespec pause = {0, 100000};
+            nanosleep(&pause, NULL);
+        }
+    }
+    free_matcher(old);
+    printf("Filter reloaded (epoch %lu)\n", epoch);
+}
+
+/* SIGHUP is blocked in every other thread and handled here synchronously. */
+void *reload_thread(void *arg) {
+    sigset_t *signals = arg;
+    while (1) {
+        int sig;
+        if (sigwait(signals, &sig) == 0 && sig == SIGHUP) {
+            printf("SIGHUP received, reloading filter\n");
+            reload_filter();
+        }
+    }
+    return NULL;
+}
+
+/* Copies a group's published top, retrying while its shard is rewriting it. */
+static int read_top(int group_id, struct RankedUser *users) {
+    const struct TopBoard *board = &top_boards[group_id];
+    unsigned int seq;
+    int count;
+    do {
+        seq = __atomic_load_n(&board->seq, __ATOMIC_ACQUIRE);
+        count = __atomic_load_n(&board->count, __ATOMIC_RELAXED);
+        for (int i = 0; i < count; i++) {
+            users[i].user_id = __atomic_load_n(&board->users[i].user_id, __ATOMIC_RELAXED);
+            users[i].score = __atomic_load_n(&board->users[i].score, __ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&board->seq, __ATOMIC_RELAXED));
+    return count;
+}
+
+static int compare_query_users(const void *a, const void *b) {
+    const struct QueryUser *x = a, *y = b;
+    return (y->score > x->score) - (y->score < x->score);
+}
+
+static void sample_activity(struct GroupActivity *sample) {
+    for (int g = 0; g < MAX_GROUPS; g++) {
+        sample[g].messages = __atomic_load_n(&group_activity[g].messages, __ATOMIC_RELAXED);
+        sample[g].violations = __atomic_load_n(&group_activity[g].violations, __ATOMIC_RELAXED);
+        sample[g].removals = __atomic_load_n(&group_activity[g].removals, __ATOMIC_RELAXED);
+    }
+}
+
+/* base is the activity sampled at base_ns, which rates are measured from. */
+static void answer_query(const struct QueryRequest *request, const struct GroupActivity *base, long long base_ns) {
+    static struct QueryUser candidates[MAX_GROUPS * QUERY_TOP_K];
+    struct RankedUser users[QUERY_TOP_K];
+    struct QueryReply reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.mtype = request->client;
+    reply.id = request->id;
+    reply.instance = instance_index;
+    reply.instance_count = instance_count;
+    reply.threshold = threshold_violations;
+
+    /* A group's top k is in its own board, so the merged boards hold the overall top k. */
+    int n = 0;
+    for (int g = 0; g < MAX_GROUPS; g++) {
+        if (request->group != -1 && request->group != g) {
+            continue;
+        }
+        int count = read_top(g, users);
+        for (int i = 0; i < count; i++) {
+            candidates[n].group_id = g;
+            candidates[n].user_id = users[i].user_id;
+            candidates[n].score = users[i].score;
+            n++;
+        }
+    }
+    qsort(candidates, n, sizeof(struct QueryUser), compare_query_users);
+    int k = request->k < 1 || request->k > QUERY_TOP_K ? QUERY_TOP_K : request->k;
+    reply.count = n < k ? n : k;
+    memcpy(reply.top, candidates, reply.count * sizeof(struct QueryUser));
+
+    struct GroupActivity now[MAX_GROUPS];
+    sample_activity(now);
+    double elapsed_s = (stats_now_ns() - base_ns) / 1e9;
+    for (int g = 0; g < MAX_GROUPS; g++) {
+        reply.groups[g].messages = now[g].messages;
+        reply.groups[g].violations = now[g].violations;
+        reply.groups[g].removals = now[g].removals;
+        if (elapsed_s > 0) {
+            reply.groups[g].message_rate = (now[g].messages - base[g].messages) / elapsed_s;
+            reply.groups[g].violation_rate = (now[g].violations - base[g].violations) / elapsed_s;
+        }
+    }
+    /* A client that went away must not be able to stall this thread. */
+    if (msgsnd(query_msgid, &reply, sizeof(reply) - sizeof(long), IPC_NOWAIT) == -1 && errno != EAGAIN) {
+        fprintf(stderr, "Error answering query: %s\n", strerror(errno));
+    }
+}
+
+/*
+ * Answers queries off the message path: it only reads the published boards
+ * and counters. It polls, like the stats sampler, so that it can also take
+ * the activity samples rates are measured against.
+ */
+void *query_server(void *arg) {
+    (void)arg;
+    struct GroupActivity older[MAX_GROUPS], newer[MAX_GROUPS];
+    sample_activity(newer);
+    memcpy(older, newer, sizeof(older));
+    long long older_ns = stats_now_ns(), newer_ns = older_ns;
+    while (1) {
+        struct QueryRequest request;
+        while (msgrcv(query_msgid, &request, sizeof(request) - sizeof(long), QUERY_REQUEST_MTYPE, IPC_NOWAIT) != -1) {
+            answer_query(&request, older, older_ns);
+        }
+        if (errno != ENOMSG && errno != EINTR) {
+            /* The queue was removed; the run is over. */
+            return NULL;
+        }
+        long long now = stats_now_ns();
+        if (now - newer_ns >= QUERY_RATE_MS * 1000000LL) {
+            memcpy(older, newer, sizeof(older));
+            older_ns = newer_ns;
+            sample_activity(newer);
+            newer_ns = now;
+        }
+        struct timespec pause = {0, QUERY_POLL_MS * 1000000L};
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+void start_query_server(int moderator_key) {
+    query_msgid = msgget(moderator_key + QUERY_KEY_OFFSET, IPC_CREAT | 0666);
+    if (query_msgid == -1) {
+        fprintf(stderr, "Queries disabled: cannot open query queue: %s\n", strerror(errno));
+        return;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, query_server, NULL) != 0) {
+        fprintf(stderr, "Error creating query thread\n");
+        exit(1);
+    }
+    pthread_detach(thread);
+    printf("Answering queries on message queue (id: %d)\n", query_msgid);
+}
+
+void start_reload_thread(void) {
+    static sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, reload_thread, &signals) != 0) {
+        fprintf(stderr, "Error creating filter reload thread\n");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+/* "moderator.out --compile-filter <test_case>": builds filtered_words.img and exits. */
+int compile_filter_image(const char *testcase_folder) {
+    char list_path[512], image_path[512];
+    snprintf(list_path, sizeof(list_path), "%s/filtered_words.txt", testcase_folder);
+    snprintf(image_path, sizeof(image_path), "%s/filtered_words.img", testcase_folder);
+    struct Matcher *m = compile_word_list(list_path);
+    if (m == NULL || write_filter_image(m, image_path) == -1) {
+        return 1;
+    }
+    printf("Wrote %s: %d filtered words (%d states, %d byte classes)\n",
+           image_path, m->total_words, m->state_count, m->class_count);
+    free_matcher(m);
+    return 0;
+}
+
+/*
+ * Copies the header of the snapshot app.c published for this test case.
+ * Returns 0 when there is none, or when it is incomplete or was built from
+ * a different input.txt.
+ */
+int read_config_snapshot(const char *testcase_folder, int test_case, struct ConfigSnapshot *out) {
+    char name[64];
+    snprintf(name, sizeof(name), "/chat-config-%d", test_case);
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct ConfigSnapshot)) {
+        close(fd);
+        return 0;
+    }
+    const struct ConfigSnapshot *snapshot = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (snapshot == MAP_FAILED) {
+        return 0;
+    }
+    int ok = __atomic_load_n(&snapshot->magic, __ATOMIC_ACQUIRE) == CONFIG_SNAPSHOT_MAGIC;
+    if (ok) {
+        *out = *snapshot;
     }
+    munmap((void *)snapshot, st.st_size);
+
+    char input_file_path[256];
+    snprintf(input_file_path, sizeof(input_file_path), "%s/input.txt", testcase_folder);
+    struct stat input_st;
+    return ok && out->version == CONFIG_SNAPSHOT_VERSION && out->test_case == test_case &&
+           stat(input_file_path, &input_st) == 0 &&
+           out->input_dev == (unsigned long long)input_st.st_dev &&
+           out->input_ino == (unsigned long long)input_st.st_ino &&
+           out->input_size == (long long)input_st.st_size &&
+           out->input_mtime_ns == (long long)input_st.st_mtim.tv_sec * 1000000000LL + input_st.st_mtim.tv_nsec;
+}
+
+/* Reads MODERATOR_SCORING: total (the default), window:<span> or decay:<half_life>. */
+void read_scoring_policy(void) {
+    const char *setting = getenv("MODERATOR_SCORING");
+    int span = 0;
+    if (setting == NULL || strcmp(setting, "total") == 0) {
+        scoring_policy = SCORE_TOTAL;
+    } else if (sscanf(setting, "window:%d", &span) == 1 && span > 0) {
+        scoring_policy = SCORE_WINDOW;
+        /* Round the window up to whole buckets. */
+        scoring_span = (span + SCORE_BUCKETS - 1) / SCORE_BUCKETS;
+    } else if (sscanf(setting, "decay:%d", &span) == 1 && span > 0) {
+        scoring_policy = SCORE_DECAY;
+        scoring_span = span;
+    } else {
+        fprintf(stderr, "Invalid MODERATOR_SCORING=%s (expected total, window:<span> or decay:<half_life>)\n", setting);
+        exit(1);
+    }
+}
 
-    if (user_violations_count < MAX_USERS * MAX_GROUPS) {
-        user_violations[user_violations_count].group_id = group_id;
-        user_violations[user_violations_count].user_id = user_id;
-        user_violations[user_violations_count].violations = new_violations;
-        user_violations_count++;
+/*
+ * Reads MODERATOR_NORMALIZE: a comma-separated list of leet, separators and
+ * repeats, "all", or "off" (the default, exact matching only).
+ */
+void read_normalize_rules(void) {
+    const char *setting = getenv("MODERATOR_NORMALIZE");
+    if (setting == NULL || strcmp(setting, "off") == 0) {
+        return;
+    }
+    char rules[256];
+    snprintf(rules, sizeof(rules), "%s", setting);
+    for (char *save, *rule = strtok_r(rules, ",", &save); rule != NULL; rule = strtok_r(NULL, ",", &save)) {
+        if (strcmp(rule, "leet") == 0) {
+            normalize_rules |= NORMALIZE_LEET;
+        } else if (strcmp(rule, "separators") == 0) {
+            normalize_rules |= NORMALIZE_SEPARATORS;
+        } else if (strcmp(rule, "repeats") == 0) {
+            normalize_rules |= NORMALIZE_REPEATS;
+        } else if (strcmp(rule, "all") == 0) {
+            normalize_rules |= NORMALIZE_LEET | NORMALIZE_SEPARATORS | NORMALIZE_REPEATS;
+        } else {
+            fprintf(stderr, "Invalid MODERATOR_NORMALIZE=%s (expected leet, separators, repeats, all or off)\n", setting);
+            exit(1);
+        }
     }
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <test_case_number>\n", argv[0]);
+    read_scoring_policy();
+    read_normalize_rules();
+    if (argc == 3 && strcmp(argv[1], "--compile-filter") == 0) {
+        char folder[256];
+        snprintf(folder, sizeof(folder), "testcase_%d", atoi(argv[2]));
+        return compile_filter_image(folder);
+    }
+    if (argc == 3 && strcmp(argv[1], "--rebalance") == 0) {
+        const char *dir_env = getenv("MODERATOR_STATE_DIR");
+        int count = atoi(argv[2]);
+        if (dir_env == NULL || count < 1 || count > MAX_MODERATORS) {
+            fprintf(stderr, "--rebalance needs MODERATOR_STATE_DIR and 1..%d instances\n", MAX_MODERATORS);
+            exit(1);
+        }
+        snprintf(state_dir, sizeof(state_dir), "%s", dir_env);
+        return rebalance_state(count) == 0 ? 0 : 1;
+    }
+    if (argc != 2 && argc != 4) {
+        fprintf(stderr, "Usage: %s <test_case_number> [<instance> <instance_count>]\n", argv[0]);
+        fprintf(stderr, "       %s --compile-filter <test_case_number>\n", argv[0]);
+        fprintf(stderr, "       %s --rebalance <instance_count>\n", argv[0]);
         exit(1);
     }
+    if (argc == 4) {
+        instance_index = atoi(argv[2]);
+        instance_count = atoi(argv[3]);
+        if (instance_count < 1 || instance_count > MAX_MODERATORS ||
+            instance_index < 0 || instance_index >= instance_count) {
+            fprintf(stderr, "Invalid moderator instance %s of %s (at most %d instances)\n", argv[2], argv[3], MAX_MODERATORS);
+            exit(1);
+        }
+    }
 
     int test_case = atoi(argv[1]);
     char testcase_folder[256];
@@ -115,30 +2694,67 @@ int main(int argc, char *argv[]) {
     printf("Using testcase folder: %s\n", testcase_folder);
 
     int n, validation_queue_key, app_groups_queue_key, moderator_groups_queue_key;
-    int moderator_msgid;
 
-    load_filtered_words(testcase_folder);
-   
-    char input_file_path[256];
-    snprintf(input_file_path, sizeof(input_file_path), "%s/input.txt", testcase_folder);
-    FILE* input_file = fopen(input_file_path, "r");
-    if (input_file == NULL) {
-        fprintf(stderr, "Error opening %s: %s\n", input_file_path, strerror(errno));
-        exit(1);
+    /* MODERATOR_THREADS > 1 enables the sharded worker pool. */
+    const char *threads_env = getenv("MODERATOR_THREADS");
+    if (threads_env != NULL) {
+        worker_count = atoi(threads_env);
+        if (worker_count < 1 || worker_count > MAX_WORKERS) {
+            fprintf(stderr, "Invalid MODERATOR_THREADS=%s (expected 1..%d)\n", threads_env, MAX_WORKERS);
+            exit(1);
+        }
     }
 
-    if (fscanf(input_file, "%d %d %d %d %d",
-    &n, &validation_queue_key, &app_groups_queue_key,
-    &moderator_groups_queue_key, &threshold_violations) != 5) {
-        fprintf(stderr, "Error reading from input.txt: Invalid format\n");
+    if (normalize_rules) {
+        printf("Normalizing messages:%s%s%s\n", normalize_rules & NORMALIZE_LEET ? " leet" : "",
+               normalize_rules & NORMALIZE_SEPARATORS ? " separators" : "",
+               normalize_rules & NORMALIZE_REPEATS ? " repeats" : "");
+    }
+    if (scoring_policy == SCORE_WINDOW) {
+        printf("Scoring violations from the last %d timestamp units\n", scoring_span * SCORE_BUCKETS);
+    } else if (scoring_policy == SCORE_DECAY) {
+        printf("Scoring violations with a half-life of %d timestamp units\n", scoring_span);
+    }
+
+    snprintf(filter_folder, sizeof(filter_folder), "%s", testcase_folder);
+    active_matcher = load_filter(filter_folder, 1);
+    if (active_matcher == NULL) {
         exit(1);
     }
 
-    printf("Read from input.txt: n=%d, validation_key=%d, app_key=%d, moderator_key=%d, threshold=%d\n",
-    n, validation_queue_key, app_groups_queue_key, moderator_groups_queue_key, threshold_violations);
+    struct ConfigSnapshot snapshot;
+    if (read_config_snapshot(testcase_folder, test_case, &snapshot)) {
+        n = snapshot.n;
+        validation_queue_key = snapshot.validation_queue_key;
+        app_groups_queue_key = snapshot.app_groups_queue_key;
+        moderator_groups_queue_key = snapshot.moderator_groups_queue_key;
+        threshold_violations = snapshot.threshold;
+        printf("Read from configuration snapshot: n=%d, validation_key=%d, app_key=%d, moderator_key=%d, threshold=%d\n",
+        n, validation_queue_key, app_groups_queue_key, moderator_groups_queue_key, threshold_violations);
+    } else {
+        char input_file_path[256];
+        snprintf(input_file_path, sizeof(input_file_path), "%s/input.txt", testcase_folder);
+        FILE* input_file = fopen(input_file_path, "r");
+        if (input_file == NULL) {
+            fprintf(stderr, "Error opening %s: %s\n", input_file_path, strerror(errno));
+            exit(1);
+        }
+
+        if (fscanf(input_file, "%d %d %d %d %d",
+        &n, &validation_queue_key, &app_groups_queue_key,
+        &moderator_groups_queue_key, &threshold_violations) != 5) {
+            fprintf(stderr, "Error reading from input.txt: Invalid format\n");
+            exit(1);
+        }
+
+        printf("Read from input.txt: n=%d, validation_key=%d, app_key=%d, moderator_key=%d, threshold=%d\n",
+        n, validation_queue_key, app_groups_queue_key, moderator_groups_queue_key, threshold_violations);
 
-    fclose(input_file);
+        fclose(input_file);
+    }
 
+    /* Instance i of several has its own queue (and bus) at a fixed offset from the configured key. */
+    moderator_groups_queue_key += instance_index * MODERATOR_KEY_STRIDE;
     moderator_msgid = msgget(moderator_groups_queue_key, 0666);
     if (moderator_msgid == -1) {
         fprintf(stderr, "Error in msgget for moderator (key: %d): %s\n",
@@ -146,47 +2762,68 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
     printf("Successfully connected to moderator message queue (id: %d)\n", moderator_msgid);
+    verdict_msgid = msgget(moderator_groups_queue_key + VERDICT_KEY_OFFSET, IPC_CREAT | 0666);
+    if (verdict_msgid == -1) {
+        fprintf(stderr, "Error in msgget for verdicts (key: %d): %s\n",
+        moderator_groups_queue_key + VERDICT_KEY_OFFSET, strerror(errno));
+        exit(1);
+    }
+
+    const char *transport = getenv("CHAT_TRANSPORT");
+    if (transport != NULL && strcmp(transport, "shm") == 0) {
+        attach_bus(moderator_groups_queue_key);
+    }
+
+    start_reload_thread();
+    start_logger();
+    start_workers();
+    start_stats(test_case, validation_queue_key);
+    start_query_server(moderator_groups_queue_key);
+
+    /* MODERATOR_STATE_DIR keeps violation totals across restarts. */
+    const char *dir_env = getenv("MODERATOR_STATE_DIR");
+    if (dir_env != NULL) {
+        snprintf(state_dir, sizeof(state_dir), "%s", dir_env);
+        start_state_persistence();
+        state_enabled = 1;
+    }
 
     Message msg;
+    union QueueFrame frame;
+    log_event(LOG_DEBUG, "Waiting for messages...\n", NULL, 0);
     while (1) {
-        printf("Waiting for message...\n");
-        if (msgrcv(moderator_msgid, &msg, sizeof(Message) - sizeof(long), 0, 0) == -1) {
-            if (errno == EINTR) continue;
-            fprintf(stderr, "Error in msgrcv: %s\n", strerror(errno));
-            exit(1);
-        }
-
-        if (msg.timestamp > MAX_TIMESTAMP) {
-            fprintf(stderr, "Error: Timestamp exceeds maximum allowed value\n");
+        if (bus) {
+            bus_receive(&msg);
+            if (msg.mtype == MODERATOR_STOP_MTYPE) {
+                stop_moderator();
+            }
+            handle_incoming(&msg, stats ? stats_now_ns() : 0);
             continue;
         }
 
-        printf("Received message from group %d, user %d: %s\n",
-        msg.modifyingGroup, msg.user, msg.mtext);
-
-        int violations = count_violations(msg.mtext);
-        update_violations(msg.modifyingGroup, msg.user, violations);
-
-        int total_violations = 0;
-        for (int i = 0; i < user_violations_count; i++) {
-            if (user_violations[i].group_id == msg.modifyingGroup && user_violations[i].user_id == msg.user) {
-                total_violations = user_violations[i].violations;
-                break;
+        ssize_t size = msgrcv(moderator_msgid, &frame, sizeof(frame) - sizeof(long), 0, 0);
+        if (size == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error in msgrcv: %s\n", strerror(errno));
+            if (state_enabled) {
+                commit_state();
             }
+            exit(1);
         }
 
-        printf("User %d from group %d has %d violations\n",
-        msg.user, msg.modifyingGroup, total_violations);
-
-        if (total_violations >= threshold_violations) {
-            printf("User %d from group %d has been removed due to %d violations.\n",
-            msg.user, msg.modifyingGroup, total_violations);
-
-            msg.mtype = msg.modifyingGroup;
-            if (msgsnd(moderator_msgid, &msg, sizeof(Message) - sizeof(long), 0) == -1) {
-                fprintf(stderr, "Error in msgsnd: %s\n", strerror(errno));
-                exit(1);
+        long long received_ns = stats ? stats_now_ns() : 0;
+        if (frame.mtype == MODERATOR_STOP_MTYPE) {
+            stop_moderator();
+        } else if (frame.mtype >= BATCH_MTYPE_BASE && frame.mtype < BATCH_MTYPE_BASE + MAX_GROUPS) {
+            unpack_batch(&frame.batch, size, received_ns);
+        } else if (frame.mtype >= MAX_GROUPS) {
+            if (frame.msg.user != VERDICT_CLOSE_USER) {
+                acknowledge_batching(frame.msg.modifyingGroup);
+            } else if (frame.msg.modifyingGroup >= 0 && frame.msg.modifyingGroup < MAX_GROUPS) {
+                /* The next run of this group id gets its own offer. */
+                batching_offered[frame.msg.modifyingGroup] = 0;
             }
+            handle_incoming(&frame.msg, received_ns);
         }
     }
 
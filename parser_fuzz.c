@@ -0,0 +1,138 @@
+/*
+ * Differential fuzz test for the group line path:
+ *
+ *   parser_fuzz.out [iterations] [seed]
+ *
+ * Checks parse_line_prefix() plus copy_text_span() against the
+ * sscanf("%d %255[^\n]") + strncpy they replaced, on random lines built
+ * from the bytes that matter to either (whitespace, signs, digits, NUL,
+ * letters), and every newline framing kernel the CPU supports against the
+ * memchr one. Lines whose timestamp overflows an int are skipped: sscanf's
+ * result is undefined there and the parser saturates on purpose. Exits 1 on
+ * the first mismatch. Built against groups.c with -DGROUPS_NO_MAIN.
+ */
+#define GROUPS_NO_MAIN
+#include "groups.c"
+
+static unsigned long long fuzz_state;
+
+static unsigned int fuzz_random(void) {
+    fuzz_state = fuzz_state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (unsigned int)(fuzz_state >> 33);
+}
+
+static const char fuzz_bytes[] = " \t\v\f\r+-0123456789abcxyz!~\x80\xff";
+
+static size_t random_line(char *line, size_t room) {
+    size_t len = fuzz_random() % 3 == 0 ? fuzz_random() % room : fuzz_random() % 24;
+    for (size_t i = 0; i < len; i++) {
+        unsigned int pick = fuzz_random() % 64;
+        if (pick == 0) {
+            line[i] = '\0';
+        } else if (pick < 24) {
+            line[i] = '0' + fuzz_random() % 10;
+        } else {
+            line[i] = fuzz_bytes[fuzz_random() % (sizeof(fuzz_bytes) - 1)];
+        }
+    }
+    return len;
+}
+
+/* Whether sscanf would read a timestamp that does not fit an int. */
+static int overflows(const char *buffer) {
+    char *end;
+    errno = 0;
+    long value = strtol(buffer, &end, 10);
+    return end != buffer && (errno == ERANGE || value > INT_MAX || value < INT_MIN);
+}
+
+static int check_line(const char *line, size_t len) {
+    char buffer[MAX_LINE_LENGTH + 1];
+    memcpy(buffer, line, len);
+    buffer[len] = '\0';
+    if (overflows(buffer)) {
+        return 1;
+    }
+
+    int expected_timestamp;
+    char expected_text[MAX_MESSAGE_LENGTH];
+    int expected_ok = sscanf(buffer, "%d %255[^\n]", &expected_timestamp, expected_text) == 2;
+
+    int timestamp;
+    const char *text;
+    int ok = parse_line_prefix(line, line + len, &timestamp, &text) == 0;
+    if (ok != expected_ok) {
+        fprintf(stderr, "Mismatch on \"%s\": sscanf %s, parser %s\n", buffer, expected_ok ? "accepts" : "rejects",
+                ok ? "accepts" : "rejects");
+        return 0;
+    }
+    if (!ok) {
+        return 1;
+    }
+    Message msg;
+    size_t text_len = line + len - text;
+    if (text_len > sizeof(msg.mtext) - 1) {
+        text_len = sizeof(msg.mtext) - 1;
+    }
+    copy_text_span(msg.mtext, text, text_len);
+    if (timestamp != expected_timestamp || strncmp(msg.mtext, expected_text, sizeof(msg.mtext)) != 0) {
+        fprintf(stderr, "Mismatch on \"%s\": sscanf %d \"%s\", parser %d \"%s\"\n", buffer, expected_timestamp,
+                expected_text, timestamp, msg.mtext);
+        return 0;
+    }
+    return 1;
+}
+
+static int check_framing(const char *name, size_t (*kernel)(const char *, size_t, uint32_t *, size_t)) {
+    static char data[4096];
+    uint32_t expected[FRAME_LINES_BATCH], found[FRAME_LINES_BATCH];
+    size_t len = fuzz_random() % sizeof(data);
+    unsigned int density = 1 + fuzz_random() % 80;
+    for (size_t i = 0; i < len; i++) {
+        data[i] = fuzz_random() % density == 0 ? '\n' : fuzz_bytes[fuzz_random() % (sizeof(fuzz_bytes) - 1)];
+    }
+    size_t max = 1 + fuzz_random() % FRAME_LINES_BATCH;
+    size_t offset = fuzz_random() % 32;
+    if (offset > len) {
+        offset = len;
+    }
+    size_t n = scan_newlines_scalar(data + offset, len - offset, expected, max);
+    size_t m = kernel(data + offset, len - offset, found, max);
+    if (n != m || memcmp(expected, found, n * sizeof(uint32_t)) != 0) {
+        fprintf(stderr, "Mismatch in %s framing: %zu newlines found, memchr found %zu (len %zu, max %zu)\n", name, m, n,
+                len - offset, max);
+        return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    fuzz_state = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+    if (argc > 3 || iterations < 1) {
+        fprintf(stderr, "Usage: %s [iterations] [seed]\n", argv[0]);
+        exit(1);
+    }
+
+    int sse2 = 0, avx2 = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    sse2 = __builtin_cpu_supports("sse2");
+    avx2 = __builtin_cpu_supports("avx2");
+#endif
+    char line[MAX_LINE_LENGTH];
+    for (long i = 0; i < iterations; i++) {
+        if (!check_line(line, random_line(line, sizeof(line)))) {
+            exit(1);
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        if (i % 8 == 0 && ((sse2 && !check_framing("sse2", scan_newlines_sse2)) ||
+                           (avx2 && !check_framing("avx2", scan_newlines_avx2)))) {
+            exit(1);
+        }
+#endif
+    }
+    printf("%ld lines matched sscanf; framing checked with memchr%s%s\n", iterations, sse2 ? ", sse2" : "",
+           avx2 ? ", avx2" : "");
+    return 0;
+}
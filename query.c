@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/msg.h>
+#include <sys/ipc.h>
+
+#define MAX_GROUPS 30
+#define MAX_MODERATORS 8
+#define MODERATOR_KEY_STRIDE 0x10000
+#define QUERY_KEY_OFFSET 0x4000
+#define QUERY_REQUEST_MTYPE 1
+#define QUERY_TOP_K 16
+#define QUERY_TIMEOUT_MS 1000
+
+/*
+ * Asks the running moderator instances for their top offenders and
+ * per-group activity and prints the merged answer:
+ *
+ *   query.out <test_case_number> [-g group] [-k count] [-i interval_ms]
+ *
+ * Without -g the top is over all groups. Each user is scored by exactly
+ * one instance (MODERATOR_INSTANCES, as for app.out), so merging the
+ * instances' tops gives the overall top. Scores are as of each user's
+ * last message. With -i the query repeats until interrupted. Layouts must
+ * match moderator.c.
+ */
+struct QueryRequest {
+    long mtype;
+    int client;
+    int id;
+    int group;
+    int k;
+};
+
+struct QueryUser {
+    int group_id;
+    int user_id;
+    int score;
+};
+
+struct QueryGroup {
+    unsigned long long messages;
+    unsigned long long violations;
+    unsigned long long removals;
+    double message_rate;
+    double violation_rate;
+};
+
+struct QueryReply {
+    long mtype;
+    int id;
+    int instance;
+    int instance_count;
+    int threshold;
+    int count;
+    struct QueryUser top[QUERY_TOP_K];
+    struct QueryGroup groups[MAX_GROUPS];
+};
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s <test_case_number> [-g group] [-k count] [-i interval_ms]\n", prog);
+    exit(1);
+}
+
+static int compare_users(const void *a, const void *b) {
+    const struct QueryUser *x = a, *y = b;
+    return (y->score > x->score) - (y->score < x->score);
+}
+
+/* Sends one request and waits for its reply; returns -1 if the instance does not answer in time. */
+static int ask(int queue_id, const struct QueryRequest *request, struct QueryReply *reply) {
+    if (msgsnd(queue_id, request, sizeof(*request) - sizeof(long), IPC_NOWAIT) == -1) {
+        return -1;
+    }
+    long long deadline = now_ms() + QUERY_TIMEOUT_MS;
+    while (now_ms() < deadline) {
+        if (msgrcv(queue_id, reply, sizeof(*reply) - sizeof(long), request->client, IPC_NOWAIT) != -1) {
+            if (reply->id == request->id) {
+                return 0;
+            }
+            continue;
+        }
+        if (errno != ENOMSG && errno != EINTR) {
+            return -1;
+        }
+        usleep(1000);
+    }
+    return -1;
+}
+
+static void print_answer(const struct QueryReply *replies, int answered, int group, int k) {
+    struct QueryUser top[MAX_MODERATORS * QUERY_TOP_K];
+    struct QueryGroup totals[MAX_GROUPS];
+    memset(totals, 0, sizeof(totals));
+    int n = 0;
+    for (int i = 0; i < answered; i++) {
+        memcpy(top + n, replies[i].top, replies[i].count * sizeof(struct QueryUser));
+        n += replies[i].count;
+        for (int g = 0; g < MAX_GROUPS; g++) {
+            totals[g].messages += replies[i].groups[g].messages;
+            totals[g].violations += replies[i].groups[g].violations;
+            totals[g].removals += replies[i].groups[g].removals;
+            totals[g].message_rate += replies[i].groups[g].message_rate;
+            totals[g].violation_rate += replies[i].groups[g].violation_rate;
+        }
+    }
+    qsort(top, n, sizeof(struct QueryUser), compare_users);
+    if (n > k) {
+        n = k;
+    }
+
+    int threshold = answered ? replies[0].threshold : 0;
+    if (group == -1) {
+        printf("=== top %d offenders, all groups (threshold %d)\n", k, threshold);
+    } else {
+        printf("=== top %d offenders, group %d (threshold %d)\n", k, group, threshold);
+    }
+    for (int i = 0; i < n; i++) {
+        printf("  %3d. group %-2d user %-4d score %-6d%s\n", i + 1, top[i].group_id, top[i].user_id, top[i].score,
+               top[i].score >= threshold ? " removed" : "");
+    }
+    unsigned long long messages = 0, violations = 0, removals = 0;
+    for (int g = 0; g < MAX_GROUPS; g++) {
+        const struct QueryGroup *q = &totals[g];
+        messages += q->messages;
+        violations += q->violations;
+        removals += q->removals;
+        if ((group != -1 && g != group) || q->messages == 0) {
+            continue;
+        }
+        printf("  group %-2d messages %llu (%.0f/s), violations %llu (%.0f/s), removals %llu\n", g, q->messages,
+               q->message_rate, q->violations, q->violation_rate, q->removals);
+    }
+    if (group == -1) {
+        printf("  total    messages %llu, violations %llu, removals %llu\n", messages, violations, removals);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    int group = -1, k = 10, interval_ms = 0;
+    int c;
+    while ((c = getopt(argc, argv, "g:k:i:")) != -1) {
+        switch (c) {
+        case 'g': group = atoi(optarg); break;
+        case 'k': k = atoi(optarg); break;
+        case 'i': interval_ms = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+    if (group < -1 || group >= MAX_GROUPS || k < 1 || k > QUERY_TOP_K) {
+        fprintf(stderr, "Invalid query: group must be 0..%d, count 1..%d\n", MAX_GROUPS - 1, QUERY_TOP_K);
+        exit(1);
+    }
+
+    char path[512];
+    snprintf(path, sizeof(path), "testcase_%d/input.txt", atoi(argv[optind]));
+    FILE *input = fopen(path, "r");
+    if (input == NULL) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    int n, validation_key, app_key, moderator_key;
+    if (fscanf(input, "%d %d %d %d", &n, &validation_key, &app_key, &moderator_key) != 4) {
+        fprintf(stderr, "Error reading from input.txt: Invalid format\n");
+        exit(1);
+    }
+    fclose(input);
+
+    int instance_count = 1;
+    const char *instances = getenv("MODERATOR_INSTANCES");
+    if (instances != NULL) {
+        instance_count = atoi(instances);
+        if (instance_count < 1 || instance_count > MAX_MODERATORS) {
+            fprintf(stderr, "Invalid MODERATOR_INSTANCES=%s (expected 1..%d)\n", instances, MAX_MODERATORS);
+            exit(1);
+        }
+    }
+    int queue_ids[MAX_MODERATORS];
+    for (int i = 0; i < instance_count; i++) {
+        int key = moderator_key + i * MODERATOR_KEY_STRIDE + QUERY_KEY_OFFSET;
+        queue_ids[i] = msgget(key, 0666);
+        if (queue_ids[i] == -1) {
+            fprintf(stderr, "Error opening query queue of moderator instance %d (key: %d): %s\n", i, key,
+                    strerror(errno));
+            exit(1);
+        }
+    }
+
+    static struct QueryReply replies[MAX_MODERATORS];
+    struct QueryRequest request = {.mtype = QUERY_REQUEST_MTYPE, .client = getpid(), .group = group, .k = k};
+    while (1) {
+        request.id++;
+        int answered = 0;
+        for (int i = 0; i < instance_count; i++) {
+            if (ask(queue_ids[i], &request, &replies[answered]) == 0) {
+                answered++;
+            } else {
+                fprintf(stderr, "Moderator instance %d did not answer\n", i);
+            }
+        }
+        if (answered == 0 && interval_ms <= 0) {
+            exit(1);
+        }
+        print_answer(replies, answered, group, k);
+        if (interval_ms <= 0) {
+            break;
+        }
+        usleep(interval_ms * 1000);
+    }
+    return 0;
+}
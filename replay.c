@@ -0,0 +1,509 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/msg.h>
+#include <sys/ipc.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+#define MAX_MESSAGE_LENGTH 256
+#define MAX_GROUPS 30
+#define BATCH_MTYPE_BASE (2 * MAX_GROUPS)
+#define BATCH_FRAME_BYTES 8192
+#define BATCH_ACK_USER -1
+#define MODERATOR_STOP_MTYPE (3 * MAX_GROUPS)
+#define VERDICT_KEY_OFFSET 0x8000
+#define QUERY_KEY_OFFSET 0x4000
+#define VERDICT_MTYPE_BASE 1
+#define VERDICT_CLOSE_USER -2
+#define TRACE_MAGIC 0x45435254
+#define TRACE_VERSION 1
+#define READY_TIMEOUT_MS 5000
+
+typedef struct {
+    long mtype;
+    int timestamp;
+    int user;
+    char mtext[256];
+    int modifyingGroup;
+} Message;
+
+/* Layout must match groups.c and moderator.c. */
+struct BatchRecordHeader {
+    int timestamp;
+    int user;
+    unsigned short len;
+} __attribute__((packed));
+
+struct BatchFrame {
+    long mtype;
+    int group;
+    int count;
+    char data[BATCH_FRAME_BYTES];
+};
+
+/* Trace file layout (GROUP_TRACE); must match groups.c. */
+struct TraceHeader {
+    unsigned int magic;
+    unsigned int version;
+    int group;
+    int reserved;
+};
+
+struct TraceRecord {
+    long long sent_ns;
+    int timestamp;
+    int user;
+    unsigned short len;
+} __attribute__((packed));
+
+/*
+ * Replays traces recorded with GROUP_TRACE=<dir> (see groups.c) into a
+ * fresh moderator.out, with no app.out, groups or user processes, so the
+ * moderator's scoring path can be profiled and different builds compared
+ * on identical input:
+ *
+ *   replay.out <test_case_number> [-r] [-x speed] [-p] [-M moderator] trace...
+ *
+ * The moderator reads testcase_<N> for its keys, threshold and filtered
+ * words as usual. Messages from all traces go out in the order they were
+ * recorded, as fast as the queue takes them, or with -r at the recorded
+ * pace (sped up -x times). They are packed into batch frames per group,
+ * as groups send them once batching is on, or sent one by one with -p.
+ *
+ * Timing starts once the moderator has answered a first close message,
+ * so its startup is not counted, and ends when it has echoed the close
+ * sent after each trace, which it does only after scoring everything
+ * before it.
+ */
+
+struct Trace {
+    const char *path;
+    const char *data;
+    size_t size;
+    size_t pos;
+    int group;
+    long messages;
+    long long first_ns;
+    long long last_ns;
+    struct TraceRecord next;
+    int has_next;
+};
+
+struct Options {
+    int test_case;
+    int recorded_rate;
+    double speed;
+    int plain;
+    const char *moderator;
+};
+
+struct Replay {
+    struct Trace traces[MAX_GROUPS];
+    int trace_count;
+    int queue_id;
+    int verdict_queue_id;
+    int query_queue_id;
+    size_t frame_limit;
+    struct BatchFrame frames[MAX_GROUPS];
+    size_t frame_used[MAX_GROUPS];
+    long messages;
+    long frames_sent;
+
+    pthread_mutex_t lock;
+    long verdicts;
+    int closed;
+    long long last_verdict_ns;
+};
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s <test_case_number> [-r] [-x speed] [-p] [-M moderator] trace...\n", prog);
+    exit(1);
+}
+
+static void open_trace(struct Replay *replay, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Error opening trace %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct TraceHeader)) {
+        fprintf(stderr, "Trace %s is too short\n", path);
+        exit(1);
+    }
+    const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Error mapping trace %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+
+    struct TraceHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+        fprintf(stderr, "%s is not a version %d trace\n", path, TRACE_VERSION);
+        exit(1);
+    }
+    if (header.group < 0 || header.group >= MAX_GROUPS) {
+        fprintf(stderr, "Trace %s has invalid group %d\n", path, header.group);
+        exit(1);
+    }
+    for (int i = 0; i < replay->trace_count; i++) {
+        if (replay->traces[i].group == header.group) {
+            fprintf(stderr, "Traces %s and %s are both from group %d\n", replay->traces[i].path, path, header.group);
+            exit(1);
+        }
+    }
+
+    struct Trace *trace = &replay->traces[replay->trace_count++];
+    trace->path = path;
+    trace->data = data;
+    trace->size = st.st_size;
+    trace->pos = sizeof(header);
+    trace->group = header.group;
+}
+
+/* Loads the trace's next record header; a record cut short ends the trace. */
+static void advance_trace(struct Trace *trace) {
+    trace->has_next = 0;
+    if (trace->pos == trace->size) {
+        return;
+    }
+    if (trace->size - trace->pos < sizeof(struct TraceRecord)) {
+        fprintf(stderr, "Trace %s is truncated after %ld messages\n", trace->path, trace->messages);
+        return;
+    }
+    memcpy(&trace->next, trace->data + trace->pos, sizeof(struct TraceRecord));
+    if (trace->next.len >= MAX_MESSAGE_LENGTH) {
+        fprintf(stderr, "Malformed record in trace %s after %ld messages\n", trace->path, trace->messages);
+        return;
+    }
+    if (trace->size - trace->pos - sizeof(struct TraceRecord) < trace->next.len) {
+        fprintf(stderr, "Trace %s is truncated after %ld messages\n", trace->path, trace->messages);
+        return;
+    }
+    trace->has_next = 1;
+}
+
+static int open_fresh_queue(int key) {
+    int stale = msgget(key, 0666);
+    if (stale != -1) {
+        msgctl(stale, IPC_RMID, NULL);
+    }
+    int id = msgget(key, IPC_CREAT | 0666);
+    if (id == -1) {
+        fprintf(stderr, "Error creating message queue (key: %d): %s\n", key, strerror(errno));
+        exit(1);
+    }
+    return id;
+}
+
+static pid_t start_moderator(const struct Options *opt) {
+    char test_case_str[32];
+    snprintf(test_case_str, sizeof(test_case_str), "%d", opt->test_case);
+    pid_t pid = fork();
+    if (pid == -1) {
+        fprintf(stderr, "Error forking moderator: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd != -1) {
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+        /* Per-message trace lines would dominate what is being measured; CHAT_LOG still overrides. */
+        setenv("CHAT_LOG", "off", 0);
+        unsetenv("MODERATOR_INSTANCES");
+        execl(opt->moderator, opt->moderator, test_case_str, (char *)NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+static void send_plain(struct Replay *replay, Message *msg) {
+    if (msgsnd(replay->queue_id, msg, sizeof(Message) - sizeof(long), 0) == -1) {
+        fprintf(stderr, "Error sending message to moderator: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+static void send_close(struct Replay *replay, int group) {
+    Message msg = {.mtype = MAX_GROUPS + group, .user = VERDICT_CLOSE_USER, .modifyingGroup = group};
+    send_plain(replay, &msg);
+}
+
+/* Waits for the moderator to echo a first close, which it does once it is reading its queue. */
+static void wait_for_moderator(struct Replay *replay, pid_t pid) {
+    int group = replay->traces[0].group;
+    send_close(replay, group);
+    long long deadline = now_ns() + READY_TIMEOUT_MS * 1000000LL;
+    Message echo;
+    while (msgrcv(replay->verdict_queue_id, &echo, sizeof(Message) - sizeof(long),
+                  VERDICT_MTYPE_BASE + group, IPC_NOWAIT) == -1) {
+        if (errno != ENOMSG && errno != EINTR) {
+            fprintf(stderr, "Error receiving from verdict queue: %s\n", strerror(errno));
+            exit(1);
+        }
+        int status;
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            fprintf(stderr, "moderator exited before it was ready\n");
+            exit(1);
+        }
+        if (now_ns() > deadline) {
+            fprintf(stderr, "moderator did not answer within %d ms\n", READY_TIMEOUT_MS);
+            kill(pid, SIGKILL);
+            exit(1);
+        }
+        usleep(1000);
+    }
+}
+
+/* Drains the verdict queue until every trace's close has been echoed. */
+static void *verdict_reader(void *arg) {
+    struct Replay *replay = arg;
+    Message verdict;
+    while (1) {
+        if (msgrcv(replay->verdict_queue_id, &verdict, sizeof(Message) - sizeof(long), 0, 0) == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error receiving from verdict queue: %s\n", strerror(errno));
+            exit(1);
+        }
+        long long t = now_ns();
+        pthread_mutex_lock(&replay->lock);
+        if (verdict.user == VERDICT_CLOSE_USER) {
+            replay->closed++;
+        } else if (verdict.user != BATCH_ACK_USER) {
+            replay->verdicts++;
+        }
+        replay->last_verdict_ns = t;
+        int done = replay->closed == replay->trace_count;
+        pthread_mutex_unlock(&replay->lock);
+        if (done) {
+            return NULL;
+        }
+    }
+}
+
+static void flush_frame(struct Replay *replay, int group) {
+    struct BatchFrame *frame = &replay->frames[group];
+    if (frame->count == 0) {
+        return;
+    }
+    frame->mtype = BATCH_MTYPE_BASE + group;
+    frame->group = group;
+    size_t size = offsetof(struct BatchFrame, data) - sizeof(long) + replay->frame_used[group];
+    if (msgsnd(replay->queue_id, frame, size, 0) == -1) {
+        fprintf(stderr, "Error sending batch to moderator: %s\n", strerror(errno));
+        exit(1);
+    }
+    frame->count = 0;
+    replay->frame_used[group] = 0;
+    replay->frames_sent++;
+}
+
+static void flush_frames(struct Replay *replay) {
+    for (int i = 0; i < replay->trace_count; i++) {
+        flush_frame(replay, replay->traces[i].group);
+    }
+}
+
+static void send_record(struct Replay *replay, const struct Options *opt, struct Trace *trace) {
+    const struct TraceRecord *record = &trace->next;
+    const char *text = trace->data + trace->pos + sizeof(struct TraceRecord);
+    if (opt->plain) {
+        Message msg = {
+            .mtype = MAX_GROUPS + trace->group,
+            .timestamp = record->timestamp,
+            .user = record->user,
+            .modifyingGroup = trace->group,
+        };
+        memcpy(msg.mtext, text, record->len);
+        msg.mtext[record->len] = '\0';
+        send_plain(replay, &msg);
+        return;
+    }
+
+    int group = trace->group;
+    struct BatchRecordHeader header = {.timestamp = record->timestamp, .user = record->user, .len = record->len};
+    if (replay->frame_used[group] + sizeof(header) + header.len > replay->frame_limit) {
+        flush_frame(replay, group);
+    }
+    struct BatchFrame *frame = &replay->frames[group];
+    memcpy(frame->data + replay->frame_used[group], &header, sizeof(header));
+    memcpy(frame->data + replay->frame_used[group] + sizeof(header), text, header.len);
+    replay->frame_used[group] += sizeof(header) + header.len;
+    frame->count++;
+}
+
+/* Sends every record in recorded order; returns when the last one is out. */
+static void replay_traces(struct Replay *replay, const struct Options *opt) {
+    long long first_ns = -1, start_ns = now_ns();
+    for (int i = 0; i < replay->trace_count; i++) {
+        advance_trace(&replay->traces[i]);
+        if (replay->traces[i].has_next && (first_ns == -1 || replay->traces[i].next.sent_ns < first_ns)) {
+            first_ns = replay->traces[i].next.sent_ns;
+        }
+    }
+
+    while (1) {
+        struct Trace *earliest = NULL;
+        for (int i = 0; i < replay->trace_count; i++) {
+            struct Trace *trace = &replay->traces[i];
+            if (trace->has_next && (earliest == NULL || trace->next.sent_ns < earliest->next.sent_ns)) {
+                earliest = trace;
+            }
+        }
+        if (earliest == NULL) {
+            break;
+        }
+        if (opt->recorded_rate) {
+            long long due_ns = start_ns + (long long)((earliest->next.sent_ns - first_ns) / opt->speed);
+            if (due_ns > now_ns()) {
+                /* Everything due so far goes out before waiting. */
+                flush_frames(replay);
+                struct timespec due = {due_ns / 1000000000LL, due_ns % 1000000000LL};
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR) {
+                }
+            }
+        }
+        send_record(replay, opt, earliest);
+        if (earliest->messages == 0) {
+            earliest->first_ns = earliest->next.sent_ns;
+        }
+        earliest->last_ns = earliest->next.sent_ns;
+        earliest->pos += sizeof(struct TraceRecord) + earliest->next.len;
+        earliest->messages++;
+        replay->messages++;
+        advance_trace(earliest);
+    }
+    flush_frames(replay);
+}
+
+int main(int argc, char *argv[]) {
+    struct Options opt = {.speed = 1.0, .moderator = "./moderator.out"};
+    int c;
+    while ((c = getopt(argc, argv, "rx:pM:")) != -1) {
+        switch (c) {
+        case 'r': opt.recorded_rate = 1; break;
+        case 'x': opt.speed = atof(optarg); break;
+        case 'p': opt.plain = 1; break;
+        case 'M': opt.moderator = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (argc - optind < 2 || opt.speed <= 0) {
+        usage(argv[0]);
+    }
+    opt.test_case = atoi(argv[optind++]);
+
+    static struct Replay replay;
+    pthread_mutex_init(&replay.lock, NULL);
+    if (argc - optind > MAX_GROUPS) {
+        fprintf(stderr, "At most %d traces (one per group)\n", MAX_GROUPS);
+        exit(1);
+    }
+    for (int i = optind; i < argc; i++) {
+        open_trace(&replay, argv[i]);
+    }
+
+    char path[512];
+    snprintf(path, sizeof(path), "testcase_%d/input.txt", opt.test_case);
+    FILE *input = fopen(path, "r");
+    if (input == NULL) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    int n, validation_key, app_key, moderator_key;
+    if (fscanf(input, "%d %d %d %d", &n, &validation_key, &app_key, &moderator_key) != 4) {
+        fprintf(stderr, "Error reading from input.txt: Invalid format\n");
+        exit(1);
+    }
+    fclose(input);
+
+    /* moderator.out only opens its queue, so it has to exist before it starts. */
+    replay.queue_id = open_fresh_queue(moderator_key);
+    replay.verdict_queue_id = open_fresh_queue(moderator_key + VERDICT_KEY_OFFSET);
+    /* The moderator would create its query queue itself; owning it here means it is removed with the others. */
+    replay.query_queue_id = open_fresh_queue(moderator_key + QUERY_KEY_OFFSET);
+    /* Frames stay well under the queue's byte limit, as groups.c sizes them. */
+    replay.frame_limit = BATCH_FRAME_BYTES;
+    struct msqid_ds info;
+    if (msgctl(replay.queue_id, IPC_STAT, &info) == 0 && info.msg_qbytes / 2 < BATCH_FRAME_BYTES) {
+        replay.frame_limit = info.msg_qbytes / 2;
+    }
+    replay.frame_limit -= offsetof(struct BatchFrame, data) - sizeof(long);
+
+    pid_t moderator_pid = start_moderator(&opt);
+    wait_for_moderator(&replay, moderator_pid);
+
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, verdict_reader, &replay) != 0) {
+        fprintf(stderr, "Error starting verdict reader\n");
+        exit(1);
+    }
+    long long start_ns = now_ns();
+    replay_traces(&replay, &opt);
+    long long sent_ns = now_ns();
+    for (int i = 0; i < replay.trace_count; i++) {
+        send_close(&replay, replay.traces[i].group);
+    }
+    pthread_join(reader, NULL);
+    long long end_ns = replay.last_verdict_ns;
+
+    Message stop = {.mtype = MODERATOR_STOP_MTYPE};
+    send_plain(&replay, &stop);
+    int status;
+    struct rusage usage;
+    wait4(moderator_pid, &status, 0, &usage);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "moderator did not exit cleanly\n");
+    }
+    msgctl(replay.queue_id, IPC_RMID, NULL);
+    msgctl(replay.verdict_queue_id, IPC_RMID, NULL);
+    msgctl(replay.query_queue_id, IPC_RMID, NULL);
+
+    long long recorded_ns = 0;
+    for (int i = 0; i < replay.trace_count; i++) {
+        const struct Trace *trace = &replay.traces[i];
+        if (trace->messages > 0 && trace->last_ns - trace->first_ns > recorded_ns) {
+            recorded_ns = trace->last_ns - trace->first_ns;
+        }
+        munmap((void *)trace->data, trace->size);
+    }
+
+    double span_s = (end_ns - start_ns) / 1e9;
+    printf("Replayed %ld messages from %d traces into %s (%s, %s)\n", replay.messages, replay.trace_count,
+           opt.moderator, opt.recorded_rate ? "recorded rate" : "as fast as possible",
+           opt.plain ? "plain messages" : "batched");
+    printf("  throughput: %.0f msgs/sec (%.2f ms until the last message was scored, %.2f ms sending, %.2f ms recorded)\n",
+           span_s > 0 ? replay.messages / span_s : 0.0, span_s * 1e3, (sent_ns - start_ns) / 1e6, recorded_ns / 1e6);
+    if (!opt.plain) {
+        printf("  frames:     %ld (%.1f messages each)\n", replay.frames_sent,
+               replay.frames_sent ? (double)replay.messages / replay.frames_sent : 0.0);
+    }
+    printf("  verdicts:   %ld\n", replay.verdicts);
+    printf("  moderator:  %.2f ms user, %.2f ms system CPU (startup included), peak RSS %ld KB\n",
+           (usage.ru_utime.tv_sec * 1e3 + usage.ru_utime.tv_usec / 1e3),
+           (usage.ru_stime.tv_sec * 1e3 + usage.ru_stime.tv_usec / 1e3), usage.ru_maxrss);
+    return 0;
+}
@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MAX_GROUPS 30
+#define STATS_MAGIC 0x54534843
+#define STATS_VERSION 3
+#define STATS_BUCKETS 256
+
+/*
+ * Live statistics, published in the POSIX shared-memory object
+ * /chat-stats-<test_case> and read by stats.out. Each group owns its
+ * GroupStats slot and the moderator owns the rest; every field has a
+ * single writer and is updated with relaxed atomics, so readers never
+ * block the pipeline and at worst see a sample that is one update old.
+ * Latencies are HDR-style log-linear histograms in nanoseconds: values
+ * below 8 get a bucket each, then every power of two is split into 8
+ * buckets, up to about 17 s. Layout must match groups.c, moderator.c
+ * and stats.c.
+ */
+struct LatencyHistogram {
+    unsigned long long count;
+    unsigned long long sum_ns;
+    unsigned long long max_ns;
+    unsigned long long buckets[STATS_BUCKETS];
+};
+
+struct GroupStats {
+    int active;
+    int pid;
+    unsigned long long bytes_read;
+    unsigned long long lines;
+    unsigned long long parse_errors;
+    unsigned long long messages_sent;
+    unsigned long long verdicts;
+    unsigned long long users_removed;
+    unsigned long long throttled_sends;
+    struct LatencyHistogram read_to_parse;
+    struct LatencyHistogram parse_to_send;
+    struct LatencyHistogram verdict_to_remove;
+};
+
+struct ModeratorGroupStats {
+    unsigned long long received;
+    unsigned long long duplicates;
+    unsigned long long violations;
+    unsigned long long removals;
+    struct LatencyHistogram receive_to_verdict;
+};
+
+struct QueueDepth {
+    unsigned long long messages;
+    unsigned long long bytes;
+    unsigned long long max_messages;
+};
+
+struct StatsSegment {
+    unsigned int magic;
+    unsigned int version;
+    struct GroupStats groups[MAX_GROUPS];
+    int moderator_pid;
+    int moderator_active;
+    unsigned long long sampled_ns;
+    struct QueueDepth moderator_queue;
+    struct QueueDepth validation_queue;
+    struct QueueDepth bus;
+    struct QueueDepth verdict_queue;
+    struct ModeratorGroupStats moderator[MAX_GROUPS];
+};
+
+/*
+ * stats.out <test_case_number> [interval_ms]: prints the live statistics of
+ * a running test case, once or every interval_ms. It maps the segment
+ * read-only and copies it before printing, so it never holds anything the
+ * pipeline waits on.
+ */
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Upper edge of a histogram bucket, in nanoseconds. */
+static unsigned long long bucket_limit(int bucket) {
+    if (bucket < 8) {
+        return bucket;
+    }
+    int e = bucket / 8 + 2;
+    return ((unsigned long long)(8 + bucket % 8 + 1) << (e - 3)) - 1;
+}
+
+static double percentile_us(const struct LatencyHistogram *h, double p) {
+    if (h->count == 0) {
+        return 0;
+    }
+    unsigned long long target = (unsigned long long)(p * h->count);
+    if (target >= h->count) {
+        target = h->count - 1;
+    }
+    unsigned long long seen = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen > target) {
+            unsigned long long limit = bucket_limit(b);
+            return (limit < h->max_ns ? limit : h->max_ns) / 1000.0;
+        }
+    }
+    return h->max_ns / 1000.0;
+}
+
+static void print_histogram(const char *stage, const struct LatencyHistogram *h) {
+    if (h->count == 0) {
+        return;
+    }
+    printf("      %-20s n=%-9llu mean %9.1f  p50 %9.1f  p99 %9.1f  p99.9 %9.1f  max %9.1f us\n",
+           stage, h->count, h->sum_ns / 1000.0 / h->count,
+           percentile_us(h, 0.50), percentile_us(h, 0.99), percentile_us(h, 0.999), h->max_ns / 1000.0);
+}
+
+static void print_queue(const char *name, const struct QueueDepth *q) {
+    printf("  %-17s %8llu messages %10llu bytes   (max %llu)\n", name, q->messages, q->bytes, q->max_messages);
+}
+
+static int process_alive(int pid) {
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+/* prev is the copy from the previous report, for rates; NULL on the first. */
+static void print_report(const struct StatsSegment *s, const struct StatsSegment *prev, double elapsed_s) {
+    time_t wall = time(NULL);
+    char when[32];
+    strftime(when, sizeof(when), "%H:%M:%S", localtime(&wall));
+    printf("=== %s  moderator pid %d (%s), sampled %.1f ms ago\n", when, s->moderator_pid,
+           process_alive(s->moderator_pid) ? "running" : "gone",
+           s->sampled_ns ? (now_ns() - (long long)s->sampled_ns) / 1e6 : 0.0);
+    print_queue("moderator queue", &s->moderator_queue);
+    print_queue("validation queue", &s->validation_queue);
+    print_queue("shared bus", &s->bus);
+    print_queue("verdict queue", &s->verdict_queue);
+
+    for (int g = 0; g < MAX_GROUPS; g++) {
+        const struct GroupStats *gs = &s->groups[g];
+        const struct ModeratorGroupStats *ms = &s->moderator[g];
+        if (gs->lines == 0 && ms->received == 0 && !gs->active) {
+            continue;
+        }
+        double sent_rate = 0, scored_rate = 0;
+        if (prev != NULL && elapsed_s > 0) {
+            sent_rate = (gs->messages_sent - prev->groups[g].messages_sent) / elapsed_s;
+            scored_rate = (ms->received - prev->moderator[g].received) / elapsed_s;
+        }
+        /* What the group sent and the moderator has not scored yet. */
+        long long behind = (long long)gs->messages_sent - (long long)ms->received;
+        printf("  group %-2d pid %-7d %-8s lines %llu (errors %llu), sent %llu (%.0f/s), scored %llu (%.0f/s), behind %lld\n",
+               g, gs->pid, gs->active ? "running" : "done", gs->lines, gs->parse_errors,
+               gs->messages_sent, sent_rate, ms->received, scored_rate, behind);
+        printf("      verdicts %llu, removed %llu, violations %llu, moderator removals %llu, read %llu bytes, throttled sends %llu\n",
+               gs->verdicts, gs->users_removed, ms->violations, ms->removals, gs->bytes_read, gs->throttled_sends);
+        printf("      duplicates %llu (%.1f%% of scored, counts taken from the moderator's cache)\n",
+               ms->duplicates, ms->received ? 100.0 * ms->duplicates / ms->received : 0.0);
+        print_histogram("read -> parse", &gs->read_to_parse);
+        print_histogram("parse -> send", &gs->parse_to_send);
+        print_histogram("receive -> verdict", &ms->receive_to_verdict);
+        print_histogram("verdict -> remove", &gs->verdict_to_remove);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s <test_case_number> [interval_ms]\n", argv[0]);
+        exit(1);
+    }
+    int interval_ms = argc == 3 ? atoi(argv[2]) : 0;
+
+    char name[64];
+    snprintf(name, sizeof(name), "/chat-stats-%d", atoi(argv[1]));
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {
+        fprintf(stderr, "Error opening %s: %s\n", name, strerror(errno));
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct StatsSegment)) {
+        fprintf(stderr, "Error: %s is not a stats segment\n", name);
+        exit(1);
+    }
+    const struct StatsSegment *live = mmap(NULL, sizeof(struct StatsSegment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (live == MAP_FAILED) {
+        fprintf(stderr, "Error mapping %s: %s\n", name, strerror(errno));
+        exit(1);
+    }
+    if (__atomic_load_n(&live->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC || live->version != STATS_VERSION) {
+        fprintf(stderr, "Error: %s has an unknown format\n", name);
+        exit(1);
+    }
+
+    struct StatsSegment *copy = malloc(sizeof(struct StatsSegment));
+    struct StatsSegment *prev = malloc(sizeof(struct StatsSegment));
+    if (copy == NULL || prev == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    int have_prev = 0;
+    long long prev_ns = 0;
+    while (1) {
+        memcpy(copy, live, sizeof(*copy));
+        long long t = now_ns();
+        print_report(copy, have_prev ? prev : NULL, (t - prev_ns) / 1e9);
+        if (interval_ms <= 0) {
+            break;
+        }
+        struct StatsSegment *swap = prev;
+        prev = copy;
+        copy = swap;
+        prev_ns = t;
+        have_prev = 1;
+        usleep(interval_ms * 1000);
+    }
+    return 0;
+}